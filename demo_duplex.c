@@ -21,57 +21,46 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "libipcdevice.h"
+
 #define PROC_NAME "demo_duplex"
 #define BUF_SIZE 4096
 
 void client(int msg_cnt, int expected, char **messages){
-    FILE *ipc = NULL;
-    size_t len, bytes_written;
+    int ipc = -1;
+    size_t len;
+    ssize_t bytes_written, bytes_read;
     char *received = NULL;
-    size_t bytes_read = 0, br_total = 0;
     pid_t pid = getpid();
 
-    ipc = fopen("/dev/ipcdevice","r+");
-    if( ipc == NULL ){
+    ipc = ipc_open_channel();
+    if( ipc == -1 ){
         printf( PROC_NAME " (%d): could not open ipc!\n", pid);
         return;
     }
 
-    received  = malloc(BUF_SIZE);
-    if( received  == NULL ){
-        printf( PROC_NAME ": could not malloc read buffer!\n");
-        fclose( ipc );
-        return;
-    }
-
     while( msg_cnt-- > 0 ){
         len = strnlen(messages[0], BUF_SIZE) + 1;
-        bytes_written = fwrite(messages[0], sizeof(char), len, ipc);
+        bytes_written = ipc_send(ipc, messages[0], len);
         if( bytes_written != len ){
-            printf( PROC_NAME " (%d): trouble writing message '%s': only wrote %d"
+            printf( PROC_NAME " (%d): trouble writing message '%s': only wrote %zd"
                 " bytes.\n", pid, messages[0], bytes_written);
         } else {
-            printf( PROC_NAME " (%d): wrote '%.*s'\n", pid, bytes_written, messages[0]);
+            printf( PROC_NAME " (%d): wrote '%.*s'\n", pid, (int)bytes_written, messages[0]);
         }
         messages++;
-        fflush(ipc);
 
         if( expected-- ){
-            printf( PROC_NAME " (%d): read '", pid );
-            do{
-                br_total = 0;
-                do{
-                    bytes_read = fread(received+br_total, sizeof(char), BUF_SIZE-br_total, ipc);
-                    br_total += bytes_read;
-                }while( received[br_total-1] != 0 && br_total != BUF_SIZE );
-                printf( "%.*s", br_total, received);
-            }while( received[br_total-1] != 0 );
-            printf( "'\n" );
-            br_total = 0;
+            bytes_read = ipc_recv_alloc(ipc, (void**)&received);
+            if( bytes_read == -1 ){
+                printf( PROC_NAME " (%d): could not read message!\n", pid);
+                break;
+            }
+            printf( PROC_NAME " (%d): read '%.*s'\n", pid, (int)bytes_read, received );
+            free( received );
         }
     }
-    fclose( ipc );
-    free( received );
+    ipc_close_channel( ipc );
 }
 
 int main(int argc, char **argv){
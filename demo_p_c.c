@@ -21,71 +21,53 @@
 #include <string.h>
 #include <unistd.h>
 
-#include "ipcdevice.h"
+#include "libipcdevice.h"
 
 #define PROC_NAME "demo_p_c"
 #define BUF_SIZE 4096
 
-int rot = 0;
-int reverse = 0;
-int base64 = 0;
+int transforms = 0;
 char * filename = 0;
 
 void consumer(int msg_cnt){
-    FILE *ipc = NULL;
+    int ipc = -1;
     char *message = NULL;
-    size_t bytes_read = 0, br_total = 0;
+    ssize_t bytes_read = 0;
 
-    ipc = fopen("/dev/ipcdevice","r");
-    if( ipc == NULL ){
+    ipc = ipc_open_channel();
+    if( ipc == -1 ){
         printf( PROC_NAME ": could not open ipc for reading!\n");
         return;
     }
 
-    message = malloc(BUF_SIZE);
-    if( message == NULL ){
-        printf( PROC_NAME ": could not malloc read buffer!\n");
-        fclose( ipc );
-        return;
-    }
-
     do{
-        printf( PROC_NAME ": read '" );
-        do{
-            br_total = 0;
-            do{
-                bytes_read = fread(message+br_total, sizeof(char), BUF_SIZE-br_total, ipc);
-                br_total += bytes_read;
-            }while( !feof(ipc) && br_total != BUF_SIZE );
-            printf( "%.*s", br_total, message);
-        }while( !feof(ipc) );
-        printf( "'\n" );
-        br_total = 0;
+        bytes_read = ipc_recv_alloc(ipc, (void**)&message);
+        if( bytes_read == -1 ){
+            printf( PROC_NAME ": could not read message!\n");
+            break;
+        }
+        printf( PROC_NAME ": read '%.*s'\n", (int)bytes_read, message );
+        free( message );
     } while( --msg_cnt > 0 );
 
-    fclose( ipc );
-    free( message );
+    ipc_close_channel( ipc );
 }
 
 void producer(int msg_cnt, char **messages){
-    FILE *ipc = NULL;
+    int ipc = -1;
     FILE *corpus = NULL;
     char *corpus_body = NULL;
-    size_t len, bytes_written;
+    size_t len;
+    ssize_t bytes_written;
     size_t corpus_length = 0;
 
-    ipc = fopen("/dev/ipcdevice","w");
-    if( ipc == NULL ){
+    ipc = ipc_open_channel();
+    if( ipc == -1 ){
         printf( PROC_NAME ": could not open ipc for writing!\n");
         return;
     }
 
-    if(reverse)
-        ioctl(fileno(ipc), IPC_IOC_REVERSE, 1);
-    if(rot)
-        ioctl(fileno(ipc), IPC_IOC_ROT13, 1);
-    if(base64)
-        ioctl(fileno(ipc), IPC_IOC_BASE64, 1);
+    ipc_set_transforms(ipc, transforms);
 
     if(filename){
         corpus = fopen(filename, "r");
@@ -94,34 +76,27 @@ void producer(int msg_cnt, char **messages){
         rewind(corpus);
         corpus_body = malloc(corpus_length);
         len = fread(corpus_body, sizeof(char), corpus_length, corpus);
-        setvbuf(ipc, NULL, _IONBF, 0);
-        bytes_written = fwrite(corpus_body, sizeof(char), len, ipc);
+        fclose(corpus);
+        bytes_written = ipc_send(ipc, corpus_body, len);
         if( bytes_written != len ){
-            printf( PROC_NAME ": trouble writing message '%.*s': only wrote %d"
-                " bytes.\n", len, messages[0], bytes_written);
+            printf( PROC_NAME ": trouble writing file '%s': only wrote %zd"
+                " bytes.\n", filename, bytes_written);
         }
-        fflush(ipc);
         free(corpus_body);
     }
     while( !filename && msg_cnt-- > 0 ){
         len = strnlen(messages[0], BUF_SIZE);
-        bytes_written = fwrite(messages[0], sizeof(char), len, ipc);
+        bytes_written = ipc_send(ipc, messages[0], len);
         if( bytes_written != len ){
-            printf( PROC_NAME ": trouble writing message '%.*s': only wrote %d"
-                " bytes.\n", len, messages[0], bytes_written);
+            printf( PROC_NAME ": trouble writing message '%.*s': only wrote %zd"
+                " bytes.\n", (int)len, messages[0], bytes_written);
         }
         messages++;
-        fflush(ipc);
     }
 
-    if(reverse)
-        ioctl(fileno(ipc), IPC_IOC_REVERSE, 0);
-    if(rot)
-        ioctl(fileno(ipc), IPC_IOC_ROT13, 0);
-    if(base64)
-        ioctl(fileno(ipc), IPC_IOC_BASE64, 0);
+    ipc_set_transforms(ipc, 0);
 
-    fclose( ipc );
+    ipc_close_channel( ipc );
 }
 
 int main(int argc, char **argv){
@@ -135,11 +110,11 @@ int main(int argc, char **argv){
     argv++;
     for(;argc;argc--, argv++){
         if( !strncmp(argv[0],"-13",3) ){
-            rot = 1;
+            transforms |= IPC_XF_ROT13;
         } else if( !strncmp(argv[0],"-64",3) ){
-            base64 = 1;
+            transforms |= IPC_XF_BASE64;
         } else if( !strncmp(argv[0],"-r",3) ){
-            reverse = 1;
+            transforms |= IPC_XF_REVERSE;
         } else if( !strncmp(argv[0],"-f",2) ){
             if( argc == 1 )
                 printf( PROC_NAME ": -f must be followed by filename\n" );
@@ -25,32 +25,104 @@
 
 #include <linux/module.h>
 
+#include <linux/atomic.h>
+#include <linux/bitops.h>
 #include <linux/cdev.h>
+#include <linux/completion.h>
 #include <linux/device.h>
+#include <linux/crc32c.h>
+#include <linux/debugfs.h>
 #include <linux/init.h>
 #include <linux/fs.h>
+#include <linux/ktime.h>
+#include <linux/lz4.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
 #include <linux/slab.h>
 #include <linux/sched.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
 #include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <asm/ioctls.h>
 #include <asm/uaccess.h>
 
 #include "ipcdevice.h"
 #include "base64.h"
 
+/*
+ * Every frame in a cbuf starts with a 4 byte length word, the top bits of
+ * which flag the optional fields that follow it:
+ *
+ * FRAME_LZ4 - the payload is LZ4 compressed; the length word is the stored
+ *             size, followed by a 4 byte word with the uncompressed size.
+ * FRAME_CRC - the stored payload is followed by a 4 byte CRC32C of it.
+ * FRAME_TYPE - a 4 byte message type follows, for readers' type filters.
+ * FRAME_TSTAMP - an 8 byte enqueue timestamp follows, for the latency
+ *                histogram; it is never handed to readers.
+ *
+ * The optional header fields appear in the order listed.
+ */
+#define FRAME_LEN_MASK 0x0FFFFFFF
+#define FRAME_LZ4      0x10000000
+#define FRAME_CRC      0x20000000
+#define FRAME_TSTAMP   0x40000000
+#define FRAME_TYPE     0x80000000
+
+/*
+ * Transformed messages at least PARALLEL_THRESHOLD long are encoded in
+ * PARALLEL_CHUNK sized pieces spread across CPUs.  The chunk is a multiple
+ * of 3 so that every piece base64 encodes independently.
+ */
+#define PARALLEL_THRESHOLD (256*1024)
+#define PARALLEL_CHUNK     (3*16*1024)
+
+/*
+ * Messages shorter than LZ4_THRESHOLD can't shrink enough to pay for
+ * staging them, so compressed channels send them inline.
+ */
+#define LZ4_THRESHOLD 128
+
+/*
+ * Ends with capture on append a struct ipc_capture_record, and up to
+ * snaplen bytes of payload, to the capture ring for every message they
+ * send.  A tap reader drains it through debugfs.  Senders never wait on the
+ * tap: a record that doesn't fit is thrown away and counted in cap_lost.
+ */
+#define CAPTURE_SIZE        (64*1024)
+#define CAPTURE_SNAPLEN_MAX 4096
+
 struct simplexinfo{
     char *cbuf, *rhead, *whead;
     int message_complete;
-    size_t len_remaining;
+    int frame_open;
+    size_t frame_flags;
+    size_t msg_len, len_remaining;
+    size_t stored_len, stored_got;
+    size_t skip_remaining;
+    int skipping;
+    u32 frame_type;
+    u64 frame_stamp;
+    u32 frame_crc;
+    char *staged, *inflated;
+    void *lz4_wrkmem;
+    struct ipc_lat_hist lat_hist;
+    struct ipc_drop_stats dropped;
+    spinlock_t drop_lock;
+    struct ipc_type_filter filter;
+    struct mutex rlock;
     const int SIZE;
     wait_queue_head_t rq;
     wait_queue_head_t wq;
 } a = {
     .SIZE = 1024,
     .message_complete = 0,
+    .frame_open = 0,
     .len_remaining = 0,
 }, b = {
     .SIZE = 1024,
     .message_complete = 0,
+    .frame_open = 0,
     .len_remaining = 0,
 };
 
@@ -60,24 +132,66 @@ struct duplexinfo{
     long reverse;
     long base64;
     long rot;
+    long lz4;
+    long crc;
+    long latency;
+    long overwrite;
+    long mtype;
+    long msgmode;
+    long capture;
+    long snaplen;
 } pipea = {
     .w = &a,
     .r = &b,
     .reverse = 0,
     .base64 = 0,
     .rot = 0,
+    .lz4 = 0,
+    .crc = 0,
+    .latency = 0,
+    .overwrite = 0,
+    .mtype = 0,
+    .msgmode = 0,
+    .capture = 0,
+    .snaplen = 0,
 }, pipeb = {
     .w = &b,
     .r = &a,
     .reverse = 0,
     .base64 = 0,
     .rot = 0,
+    .lz4 = 0,
+    .crc = 0,
+    .latency = 0,
+    .overwrite = 0,
+    .mtype = 0,
+    .msgmode = 0,
+    .capture = 0,
+    .snaplen = 0,
 };
 
 unsigned int connections = 0;
 static struct cdev ipc_cdev;
 static struct class *ipc_class;
 static struct device *ipc_dev;
+static struct workqueue_struct *ipc_wq;
+static struct dentry *ipc_debugfs;
+
+// head and tail run freely; CAPTURE_SIZE is a power of 2, so they wrap cleanly
+static char *cap_buf;
+static size_t cap_head, cap_tail;
+static u64 cap_lost;
+static DEFINE_SPINLOCK(cap_lock);
+
+struct transform_work{
+    struct work_struct work;
+    struct duplexinfo *di;
+    const char *src;
+    size_t count;
+    char *dst;
+    atomic_t *pending;
+    struct completion *done;
+};
 
 int simplexinfo_init(struct simplexinfo*);
 void simplexinfo_destroy(struct simplexinfo*);
@@ -104,7 +218,7 @@ size_t pop_length(char **buf, char *basis, const size_t size){
     size_t len = 0;
     int i = 0;
     for(;i<4;i++){
-        len += ((*buf)[0]&0xFF)<<(8*i);
+        len += ((size_t)(*buf)[0]&0xFF)<<(8*i);
         *buf = circ_buf_offset(*buf, basis, 1, size);
     }
     return len;
@@ -118,6 +232,666 @@ void put_length(char **buf, char *basis, const size_t size, size_t len){
     }
 }
 
+inline char rot13(char c){
+    if( c >= 'A' && c <= 'Z' )
+        return 'A' + ((c - 'A' + 13)%26);
+    else if( c >= 'a' && c <= 'z' )
+        return 'a' + ((c - 'a' + 13)%26);
+    return c;
+}
+
+size_t transformed_length(struct duplexinfo *di, size_t count){
+    if( di->base64 )
+        return (count/3 + !!(count%3))*4;
+    return count;
+}
+
+/*
+ * Apply the writer's transforms to count bytes of src, producing
+ * transformed_length(di, count) bytes at dst.  This is the linear
+ * counterpart of the loop in ipcdevice_write, for messages that are staged
+ * in kernel memory rather than encoded straight into the cbuf.
+ */
+void transform_buf(struct duplexinfo *di, const char *src, size_t count, char *dst){
+    const char *curs = src;
+    int incr = 1;
+    int in_chunk_iter;
+    char cur_char;
+    union base64_translator trans;
+
+    if( di->reverse ){
+        curs = src+count-1;
+        incr = -1;
+    }
+    if( !di->base64 ){
+        for(; count > 0; --count, curs+=incr)
+            *dst++ = di->rot ? rot13(*curs) : *curs;
+        return;
+    }
+    trans.input[0] = trans.input[1] = trans.input[2] = 0;
+    while( count > 0 ){
+        for(in_chunk_iter = 2; in_chunk_iter >= 0 && count != 0; --in_chunk_iter, curs+=incr, --count){
+            cur_char = *curs;
+            trans.input[in_chunk_iter] = di->rot ? rot13(cur_char) : cur_char;
+        }
+        dst[0] = base64_table[trans.f1];
+        dst[1] = base64_table[trans.f2];
+        dst[2] = base64_table[trans.f3];
+        dst[3] = base64_table[trans.f4];
+        trans.input[0] = trans.input[1] = trans.input[2] = 0;
+        for(; in_chunk_iter >= 0; --in_chunk_iter){
+            dst[3-in_chunk_iter] = '=';
+        }
+        dst += 4;
+    }
+}
+
+void transform_work_fn(struct work_struct *work){
+    struct transform_work *tw = container_of(work, struct transform_work, work);
+
+    transform_buf(tw->di, tw->src, tw->count, tw->dst);
+    if( atomic_dec_and_test(tw->pending) )
+        complete(tw->done);
+}
+
+/*
+ * transform_buf for staged messages: large ones are split into chunks that
+ * are queued on ipc_wq and encoded concurrently.  Returns once every chunk
+ * is done.
+ */
+void transform_staged(struct duplexinfo *di, const char *src, size_t count, char *dst){
+    struct duplexinfo xf = *di;
+    struct transform_work *works;
+    atomic_t pending;
+    DECLARE_COMPLETION_ONSTACK(done);
+    size_t chunks, i, off, len;
+
+    if( count < PARALLEL_THRESHOLD ){
+        transform_buf(&xf, src, count, dst);
+        return;
+    }
+
+    chunks = DIV_ROUND_UP(count, PARALLEL_CHUNK);
+    works = kcalloc(chunks, sizeof(*works), GFP_KERNEL);
+    if( works == NULL ){
+        transform_buf(&xf, src, count, dst);
+        return;
+    }
+
+    atomic_set(&pending, chunks);
+    for(i = 0; i < chunks; i++){
+        off = i*PARALLEL_CHUNK;
+        len = _min(PARALLEL_CHUNK, count - off);
+        works[i].di = &xf;
+        // a reversed message's output chunk comes from the mirrored input
+        works[i].src = xf.reverse ? src + count - off - len : src + off;
+        works[i].count = len;
+        works[i].dst = dst + transformed_length(&xf, off);
+        works[i].pending = &pending;
+        works[i].done = &done;
+        INIT_WORK(&works[i].work, transform_work_fn);
+        queue_work(ipc_wq, &works[i].work);
+    }
+    wait_for_completion(&done);
+    kfree(works);
+}
+
+size_t header_size(size_t word){
+    size_t size = 4;
+    if( word & FRAME_LZ4 )
+        size += 4;
+    if( word & FRAME_TYPE )
+        size += 4;
+    if( word & FRAME_TSTAMP )
+        size += 8;
+    return size;
+}
+
+/* how much of the cbuf a whole frame occupies */
+size_t frame_size(size_t word){
+    return header_size(word) + (word & FRAME_LEN_MASK) + ((word & FRAME_CRC) ? 4 : 0);
+}
+
+size_t frame_flags(struct duplexinfo *di){
+    return (di->crc ? FRAME_CRC : 0) | (di->latency ? FRAME_TSTAMP : 0) |
+        (di->mtype ? FRAME_TYPE : 0);
+}
+
+size_t circ_free_space(struct simplexinfo *this){
+    return (this->SIZE + (this->rhead - this->whead) - 1) % this->SIZE;
+}
+
+int wait_for_space(struct simplexinfo *this, size_t n){
+    if( circ_free_space(this) < n ){
+        wake_up_interruptible_sync(&this->rq);
+        return wait_event_interruptible(this->wq, ( circ_free_space(this) >= n) );
+    }
+    return 0;
+}
+
+/*
+ * Wait for room for a frame header and publish it in one go.  msg_len is
+ * only stored for compressed frames, whose length word is the stored size.
+ */
+int put_header(struct duplexinfo *di, size_t word, size_t msg_len){
+    struct simplexinfo *this = di->w;
+    char *wh_curs;
+    u64 now;
+    int result;
+
+    result = wait_for_space(this, header_size(word));
+    if( result != 0 )
+        return result;
+
+    wh_curs = this->whead;
+    put_length(&wh_curs, this->cbuf, this->SIZE, word);
+    if( word & FRAME_LZ4 )
+        put_length(&wh_curs, this->cbuf, this->SIZE, msg_len);
+    if( word & FRAME_TYPE )
+        put_length(&wh_curs, this->cbuf, this->SIZE, di->mtype);
+    if( word & FRAME_TSTAMP ){
+        now = ktime_get_ns();
+        put_length(&wh_curs, this->cbuf, this->SIZE, now & 0xFFFFFFFF);
+        put_length(&wh_curs, this->cbuf, this->SIZE, now >> 32);
+    }
+    this->whead = wh_curs;
+    return 0;
+}
+
+int put_trailer(struct simplexinfo *this, u32 crc){
+    char *wh_curs;
+    int result;
+
+    result = wait_for_space(this, 4);
+    if( result != 0 )
+        return result;
+
+    wh_curs = this->whead;
+    put_length(&wh_curs, this->cbuf, this->SIZE, crc);
+    this->whead = wh_curs;
+    return 0;
+}
+
+int type_matches(struct simplexinfo *this, u32 type){
+    return type >= this->filter.min && type <= this->filter.max;
+}
+
+/*
+ * Wake the reader for a newly published frame, unless its filter would
+ * just have it throw the frame away.  Once the cbuf is half full it is
+ * woken regardless, to clear out the frames it doesn't want before they
+ * crowd out the ones it does.
+ */
+void wake_reader(struct duplexinfo *di){
+    if( type_matches(di->w, di->mtype) ||
+            circ_free_space(di->w) < di->w->SIZE/2 )
+        wake_up_interruptible_sync(&di->w->rq);
+}
+
+void record_latency(struct simplexinfo *this, u64 stamp){
+    u64 now = ktime_get_ns();
+    int bucket = fls64(now > stamp ? now - stamp : 0);
+
+    if( bucket >= IPC_LAT_BUCKETS )
+        bucket = IPC_LAT_BUCKETS-1;
+    this->lat_hist.count[bucket]++;
+}
+
+/*
+ * Checksum n bytes of the cbuf starting at from, which may wrap.
+ */
+u32 circ_crc32c(u32 crc, struct simplexinfo *this, char *from, size_t n){
+    size_t to_bb_end = this->SIZE-(from-this->cbuf);
+
+    if( n > to_bb_end ){
+        crc = crc32c(crc, from, to_bb_end);
+        from = this->cbuf;
+        n -= to_bb_end;
+    }
+    return crc32c(crc, from, n);
+}
+
+/*
+ * Copy a staged payload into the cbuf, blocking whenever the reader
+ * falls behind.  If crc is given, the bytes are checksummed as they land.
+ */
+int circ_put_bytes(struct simplexinfo *this, const char *src, size_t n, u32 *crc){
+    size_t to_write, to_bb_end;
+    int result;
+
+    while( n > 0 ){
+        result = wait_for_space(this, 1);
+        if( result != 0 )
+            return result;
+
+        to_bb_end = this->SIZE-(this->whead-this->cbuf);
+        to_write = _min(circ_free_space(this), _min(to_bb_end, n));
+        memcpy(this->whead, src, to_write);
+        if( crc != NULL )
+            *crc = crc32c(*crc, this->whead, to_write);
+        this->whead = circ_buf_offset(this->whead, this->cbuf, to_write, this->SIZE);
+        src += to_write;
+        n -= to_write;
+    }
+    return 0;
+}
+
+/*
+ * Copy n bytes of the cbuf starting at rhead, which may wrap, out to buf
+ * without consuming them.
+ */
+int circ_copy_to_user(struct simplexinfo *this, char __user *buf, size_t n){
+    size_t to_bb_end = this->SIZE-(this->rhead-this->cbuf);
+    size_t first = _min(n, to_bb_end);
+
+    if( copy_to_user(buf, this->rhead, first) ||
+            copy_to_user(buf + first, this->cbuf, n - first) )
+        return -EFAULT;
+    return 0;
+}
+
+int wait_for_data(struct simplexinfo *this, size_t n){
+    if( circ_head_space(this->rhead, this->whead, this->SIZE) < n ){
+        wake_up_interruptible_sync(&this->wq);
+        return wait_event_interruptible(this->rq,
+            ( circ_head_space(this->rhead, this->whead, this->SIZE) >= n) );
+    }
+    return 0;
+}
+
+/*
+ * Pop the next frame header so its length can be inspected before any of the
+ * payload is consumed.  Only blocks when block is set; otherwise returns
+ * -EAGAIN if no header has arrived yet.
+ */
+int open_frame(struct simplexinfo *this, int block){
+    int result;
+    char *curs;
+    size_t word;
+
+    if( this->frame_open )
+        return 0;
+
+    if( !block && circ_head_space(this->rhead, this->whead, this->SIZE) < 4 )
+        return -EAGAIN;
+    result = wait_for_data(this, 4);
+    if( result != 0 )
+        return result;
+
+    // the writer publishes the whole header at once, so the optional
+    // fields are already there once the length word is
+    curs = this->rhead;
+    word = pop_length(&curs, this->cbuf, this->SIZE);
+    if( !block && circ_head_space(this->rhead, this->whead, this->SIZE) < header_size(word) )
+        return -EAGAIN;
+    result = wait_for_data(this, header_size(word));
+    if( result != 0 )
+        return result;
+
+    this->rhead = curs;
+    this->frame_flags = word & ~FRAME_LEN_MASK;
+    this->len_remaining = word & FRAME_LEN_MASK;
+    this->stored_len = this->len_remaining;
+    this->stored_got = 0;
+    if( this->frame_flags & FRAME_LZ4 )
+        this->len_remaining = pop_length(&this->rhead, this->cbuf, this->SIZE);
+    this->frame_type = 0;
+    if( this->frame_flags & FRAME_TYPE )
+        this->frame_type = pop_length(&this->rhead, this->cbuf, this->SIZE);
+    if( this->frame_flags & FRAME_TSTAMP ){
+        this->frame_stamp = pop_length(&this->rhead, this->cbuf, this->SIZE);
+        this->frame_stamp |= (u64)pop_length(&this->rhead, this->cbuf, this->SIZE) << 32;
+    }
+    this->msg_len = this->len_remaining;
+    this->frame_crc = ~0;
+    // decided once, so changing the filter can't strand a half skipped frame
+    this->skipping = !type_matches(this, this->frame_type);
+    this->skip_remaining = frame_size(word) - header_size(word);
+    this->frame_open = 1;
+    return 0;
+}
+
+/*
+ * Once a frame's stored payload has been copied out, check its CRC32C
+ * trailer against the checksum accumulated along the way.
+ */
+int verify_frame(struct simplexinfo *this, int block){
+    u32 expected;
+    int result;
+
+    if( !(this->frame_flags & FRAME_CRC) )
+        return 0;
+
+    if( !block && circ_head_space(this->rhead, this->whead, this->SIZE) < 4 )
+        return -EAGAIN;
+    result = wait_for_data(this, 4);
+    if( result != 0 )
+        return result;
+
+    expected = pop_length(&this->rhead, this->cbuf, this->SIZE);
+    this->frame_flags &= ~FRAME_CRC;
+    if( expected != this->frame_crc )
+        return -EBADMSG;
+    return 0;
+}
+
+void close_frame(struct simplexinfo *this){
+    if( this->staged != NULL ){
+        kvfree(this->staged);
+        this->staged = NULL;
+    }
+    if( this->inflated != NULL ){
+        kvfree(this->inflated);
+        this->inflated = NULL;
+    }
+    this->frame_open = 0;
+}
+
+/*
+ * Consume the rest of a frame the reader's filter doesn't want, without
+ * copying it anywhere.  Returns -EAGAIN if !block and the writer is still
+ * producing it.
+ */
+int skip_frame(struct simplexinfo *this, int block){
+    size_t to_skip;
+    int result;
+
+    while( this->skip_remaining > 0 ){
+        if( !block && this->rhead == this->whead )
+            return -EAGAIN;
+        result = wait_for_data(this, 1);
+        if( result != 0 )
+            return result;
+
+        to_skip = _min(circ_head_space(this->rhead, this->whead, this->SIZE),
+            this->skip_remaining);
+        this->rhead = circ_buf_offset(this->rhead, this->cbuf, to_skip, this->SIZE);
+        this->skip_remaining -= to_skip;
+    }
+    wake_up_interruptible_sync(&this->wq);
+    this->len_remaining = 0;
+    close_frame(this);
+    return 0;
+}
+
+/*
+ * open_frame for the next message that passes the reader's type filter.
+ */
+int next_frame(struct simplexinfo *this, int block){
+    int result;
+
+    for(;;){
+        result = open_frame(this, block);
+        if( result != 0 || !this->skipping )
+            return result;
+        result = skip_frame(this, block);
+        if( result != 0 )
+            return result;
+    }
+}
+
+/*
+ * Overwrite mode: discard the oldest messages in the cbuf until there is
+ * room for n bytes.  Called with rlock held, so the reader is between
+ * calls; if it is part way through a message, the rest of that message goes
+ * first.  Every frame behind it is complete, since the one writer only
+ * makes room between frames.
+ */
+void count_drop(struct simplexinfo *this, size_t bytes){
+    spin_lock(&this->drop_lock);
+    this->dropped.messages++;
+    this->dropped.bytes += bytes;
+    spin_unlock(&this->drop_lock);
+}
+
+void drop_oldest(struct simplexinfo *this, size_t n){
+    char *curs;
+    size_t word, in_cbuf, trailer, head_space;
+
+    while( circ_free_space(this) < n &&
+            (head_space = circ_head_space(this->rhead, this->whead, this->SIZE)) > 0 ){
+        if( this->frame_open && this->inflated == NULL ){
+            trailer = (this->frame_flags & FRAME_CRC) ? 4 : 0;
+            if( this->skipping ){
+                in_cbuf = this->skip_remaining;
+                trailer = _min(trailer, in_cbuf);
+            } else {
+                in_cbuf = this->stored_len - this->stored_got + trailer;
+            }
+            // a writer that gave up part way never finished this one
+            if( in_cbuf > head_space ){
+                in_cbuf = head_space;
+                trailer = 0;
+            }
+            // a stream reader that already has part of it sees it end early
+            if( !this->skipping && !(this->frame_flags & FRAME_LZ4) &&
+                    this->len_remaining != this->msg_len )
+                this->message_complete = 1;
+            this->rhead = circ_buf_offset(this->rhead, this->cbuf, in_cbuf, this->SIZE);
+            // like a whole frame, count the stored payload but not the CRC
+            count_drop(this, in_cbuf - trailer);
+            this->len_remaining = 0;
+            close_frame(this);
+            continue;
+        }
+
+        curs = this->rhead;
+        word = head_space >= 4 ? pop_length(&curs, this->cbuf, this->SIZE) : 0;
+        // nor this one, so there is nothing sound to skip by; start afresh
+        if( head_space < 4 || frame_size(word) > head_space ){
+            this->rhead = this->whead;
+            count_drop(this, head_space);
+            break;
+        }
+        this->rhead = circ_buf_offset(this->rhead, this->cbuf, frame_size(word), this->SIZE);
+        count_drop(this, word & FRAME_LEN_MASK);
+    }
+}
+
+/*
+ * Overwrite mode: make room for the frame described by word without ever
+ * sleeping.  Dropping old frames moves rhead, which needs rlock; if the
+ * reader has it, the new message is discarded instead and -ENOBUFS is
+ * returned.
+ */
+int make_room(struct simplexinfo *this, size_t word){
+    size_t n = frame_size(word);
+
+    if( n > this->SIZE-1 )
+        return -EMSGSIZE;
+    if( circ_free_space(this) >= n )
+        return 0;
+
+    // the reader may be asleep on rlock's behalf, having never been woken
+    // for frames its filter skips; let it clear them out
+    wake_up_interruptible_sync(&this->rq);
+    if( !mutex_trylock(&this->rlock) ){
+        count_drop(this, word & FRAME_LEN_MASK);
+        return -ENOBUFS;
+    }
+    drop_oldest(this, n);
+    mutex_unlock(&this->rlock);
+    return 0;
+}
+
+/*
+ * Gather the stored bytes of a frame out of the cbuf into inflated, so the
+ * message can be handed out from kernel memory: compressed frames, which
+ * are decompressed on the way, and message mode frames too big to ever sit
+ * in the cbuf whole.  Safe to call again after a signal interrupts the
+ * gather, or after it returns -EAGAIN when !block; it picks up where it left
+ * off.
+ */
+int stage_frame(struct simplexinfo *this, int block){
+    size_t to_read, to_bb_end;
+    int result;
+
+    if( this->inflated != NULL )
+        return 0;
+
+    if( this->staged == NULL ){
+        this->staged = kvmalloc(this->stored_len, GFP_KERNEL);
+        if( this->staged == NULL )
+            return -ENOMEM;
+    }
+
+    while( this->stored_got < this->stored_len ){
+        if( !block && this->rhead == this->whead ){
+            wake_up_interruptible_sync(&this->wq);
+            return -EAGAIN;
+        }
+        result = wait_for_data(this, 1);
+        if( result != 0 )
+            return result;
+
+        to_bb_end = this->SIZE-(this->rhead-this->cbuf);
+        to_read = _min(circ_head_space(this->rhead, this->whead, this->SIZE),
+            _min(to_bb_end, this->stored_len - this->stored_got));
+        memcpy(this->staged + this->stored_got, this->rhead, to_read);
+        if( this->frame_flags & FRAME_CRC )
+            this->frame_crc = crc32c(this->frame_crc, this->rhead, to_read);
+        this->rhead = circ_buf_offset(this->rhead, this->cbuf, to_read, this->SIZE);
+        this->stored_got += to_read;
+    }
+    wake_up_interruptible_sync(&this->wq);
+
+    result = verify_frame(this, block);
+    if( result == -EBADMSG )
+        close_frame(this);
+    if( result != 0 )
+        return result;
+
+    if( !(this->frame_flags & FRAME_LZ4) ){
+        this->inflated = this->staged;
+        this->staged = NULL;
+        return 0;
+    }
+
+    this->inflated = kvmalloc(this->msg_len, GFP_KERNEL);
+    if( this->inflated == NULL )
+        return -ENOMEM;
+
+    result = LZ4_decompress_safe(this->staged, this->inflated,
+        this->stored_len, this->msg_len);
+    kvfree(this->staged);
+    this->staged = NULL;
+    if( result != this->msg_len ){
+        // nothing sensible can be handed out; drop the whole frame
+        close_frame(this);
+        return -EIO;
+    }
+    return 0;
+}
+
+int capture_flags(struct duplexinfo *di){
+    return (di->rot ? IPC_CAP_ROT13 : 0) | (di->base64 ? IPC_CAP_BASE64 : 0) |
+        (di->reverse ? IPC_CAP_REVERSE : 0) | (di->lz4 ? IPC_CAP_LZ4 : 0) |
+        (di->crc ? IPC_CAP_CRC32C : 0) | (di->latency ? IPC_CAP_LATENCY : 0) |
+        (di->overwrite ? IPC_CAP_OVERWRITE : 0);
+}
+
+void cap_copy_in(const char *src, size_t n){
+    size_t off = cap_head % CAPTURE_SIZE;
+    size_t first = _min(n, CAPTURE_SIZE - off);
+
+    memcpy(cap_buf + off, src, first);
+    memcpy(cap_buf, src + first, n - first);
+    cap_head += n;
+}
+
+void cap_copy_out(char *dst, size_t from, size_t n){
+    size_t off = from % CAPTURE_SIZE;
+    size_t first = _min(n, CAPTURE_SIZE - off);
+
+    memcpy(dst, cap_buf + off, first);
+    memcpy(dst + first, cap_buf, n - first);
+}
+
+/*
+ * Append a record of a message di just sent to the capture ring, or count
+ * it lost if the tap hasn't left room for it.
+ */
+void capture_message(struct duplexinfo *di, const char __user *buf, size_t count, u64 stamp){
+    struct ipc_capture_record rec;
+    char *snap = NULL;
+
+    rec.tstamp = stamp;
+    rec.length = count;
+    rec.captured = _min(count, di->snaplen);
+    rec.type = di->mtype;
+    rec.direction = (di == &pipeb);
+    rec.transforms = capture_flags(di);
+    if( rec.captured > 0 ){
+        // copied before taking the lock, since it may fault
+        snap = kmalloc(rec.captured, GFP_KERNEL);
+        if( snap == NULL || copy_from_user(snap, buf, rec.captured) )
+            rec.captured = 0;
+    }
+
+    spin_lock(&cap_lock);
+    if( CAPTURE_SIZE - (cap_head - cap_tail) < sizeof(rec) + rec.captured ){
+        cap_lost++;
+    } else {
+        cap_copy_in((char *)&rec, sizeof(rec));
+        cap_copy_in(snap, rec.captured);
+    }
+    spin_unlock(&cap_lock);
+    kfree(snap);
+}
+
+/*
+ * Hand the tap reader as many whole records as fit in count.  An empty ring
+ * reads as end of file, so a tap polls.
+ */
+static ssize_t capture_read(struct file *filp, char __user *buf,
+        size_t count, loff_t *ppos){
+    struct ipc_capture_record rec;
+    char *bounce;
+    size_t got = 0, n;
+    ssize_t result;
+
+    count = _min(count, CAPTURE_SIZE);
+    bounce = vmalloc(count);
+    if( bounce == NULL )
+        return -ENOMEM;
+
+    spin_lock(&cap_lock);
+    while( cap_head - cap_tail >= sizeof(rec) ){
+        cap_copy_out((char *)&rec, cap_tail, sizeof(rec));
+        n = sizeof(rec) + rec.captured;
+        if( got + n > count )
+            break;
+        cap_copy_out(bounce + got, cap_tail, n);
+        cap_tail += n;
+        got += n;
+    }
+    // a buffer too small for the next record would otherwise look like EOF
+    result = (got == 0 && cap_head != cap_tail) ? -EINVAL : got;
+    spin_unlock(&cap_lock);
+
+    if( result > 0 && copy_to_user(buf, bounce, got) )
+        result = -EFAULT;
+    vfree(bounce);
+    return result;
+}
+
+const struct file_operations capture_fops = {
+    .owner = THIS_MODULE,
+    .read  = capture_read,
+    .llseek = noop_llseek,
+};
+
+void simplexinfo_reset(struct simplexinfo *this){
+    close_frame(this);
+    this->message_complete = 0;
+    this->len_remaining = 0;
+    this->whead = this->rhead = this->cbuf;
+    memset(&this->lat_hist, 0, sizeof(this->lat_hist));
+    memset(&this->dropped, 0, sizeof(this->dropped));
+    this->filter.min = 0;
+    this->filter.max = ~0U;
+}
+
 const struct file_operations ipcdevice_fops = {
     .owner = THIS_MODULE,
     .open  = ipcdevice_open,
@@ -132,13 +906,25 @@ int simplexinfo_init(struct simplexinfo *this){
     if (this->cbuf == NULL){
         return -ENOMEM;
     }
+    this->lz4_wrkmem = vmalloc(LZ4_MEM_COMPRESS);
+    if (this->lz4_wrkmem == NULL){
+        kfree(this->cbuf);
+        this->cbuf = NULL;
+        return -ENOMEM;
+    }
     this->cbuf[0] = 0;
+    mutex_init(&this->rlock);
+    spin_lock_init(&this->drop_lock);
     init_waitqueue_head(&this->rq);
     init_waitqueue_head(&this->wq);
     return 0;
 }
 
 void simplexinfo_destroy(struct simplexinfo *this){
+    close_frame(this);
+    if( this->lz4_wrkmem != NULL ){
+        vfree(this->lz4_wrkmem);
+    }
     if( this->cbuf != NULL ){
         kfree(this->cbuf);
     }
@@ -148,12 +934,8 @@ int ipcdevice_open(struct inode *inode, struct file *filp)
 {
     switch(connections){
     case 0:
-        a.message_complete = 0;
-        a.len_remaining = 0;
-        a.whead = a.rhead = a.cbuf;
-        b.message_complete = 0;
-        b.len_remaining = 0;
-        b.whead = b.rhead = b.cbuf;
+        simplexinfo_reset(&a);
+        simplexinfo_reset(&b);
         filp->private_data = &pipea;
         break;
 
@@ -174,11 +956,14 @@ int ipcdevice_release(struct inode *inode, struct file *filp)
     return 0;
 }
 
-static ssize_t ipcdevice_read(struct file *filp, char __user *buf,
-        size_t count, loff_t *ppos){
+/*
+ * Read the next message, or as much of it as fits, for di's reader.  If
+ * !block, returns -EAGAIN rather than waiting for one to arrive; in message
+ * mode that includes waiting for the rest of one that has started.
+ */
+ssize_t read_frame(struct duplexinfo *di, char __user *buf, size_t count, int block){
     int result;
-    size_t len = 0, to_read = 0, head_space = 0, bytes_read = 0, to_bb_end = 0;
-    struct duplexinfo *di = filp->private_data;
+    size_t to_read = 0, head_space = 0, bytes_read = 0, to_bb_end = 0, trailer;
     struct simplexinfo *this = di->r;
 
     if( this->message_complete ){
@@ -186,91 +971,260 @@ static ssize_t ipcdevice_read(struct file *filp, char __user *buf,
         return 0;
     }
 
-    len = this->len_remaining;
-    if( len == 0 ){
-        if( circ_head_space(this->rhead, this->whead, this->SIZE) < 4){
+    result = next_frame(this, block);
+    if( result != 0 )
+        return result;
+
+    // in message mode a message is only ever handed out whole
+    if( di->msgmode && count < this->len_remaining )
+        return -EMSGSIZE;
+
+    // a message mode read consumes nothing until it can hand the message out
+    // in one go, so a signal never leaves one half delivered
+    trailer = (this->frame_flags & FRAME_CRC) ? 4 : 0;
+    if( this->inflated != NULL || (this->frame_flags & FRAME_LZ4) ||
+            (di->msgmode && this->len_remaining + trailer > this->SIZE-1) ){
+        result = stage_frame(this, block);
+        if( result != 0 )
+            return result;
+        bytes_read = _min(this->len_remaining, count);
+        // on a fault the message stays staged for the next read
+        if( copy_to_user(buf, this->inflated + (this->msg_len - this->len_remaining), bytes_read) )
+            return -EFAULT;
+        this->len_remaining -= bytes_read;
+        count -= bytes_read;
+    } else if( di->msgmode ){
+        if( !block && circ_head_space(this->rhead, this->whead, this->SIZE) <
+                this->len_remaining + trailer ){
             wake_up_interruptible_sync(&this->wq);
-            result = wait_event_interruptible(this->rq, ( circ_head_space(this->rhead, this->whead, this->SIZE) >= 4) );
-            if( result != 0 )
-                return result;
+            return -EAGAIN;
         }
+        result = wait_for_data(this, this->len_remaining + trailer);
+        if( result != 0 )
+            return result;
 
-        len = pop_length(&this->rhead, this->cbuf, this->SIZE);
+        // copied out whole before any of it is consumed, so a fault
+        // leaves the message in the cbuf
+        bytes_read = this->len_remaining;
+        result = circ_copy_to_user(this, buf, bytes_read);
+        if( result != 0 )
+            return result;
+        if( this->frame_flags & FRAME_CRC )
+            this->frame_crc = circ_crc32c(this->frame_crc, this, this->rhead, bytes_read);
+        this->rhead = circ_buf_offset(this->rhead, this->cbuf, bytes_read, this->SIZE);
+        this->stored_got += bytes_read;
+        this->len_remaining = 0;
+        count -= bytes_read;
     }
 
-    do{
-        if(this->rhead == this->whead){
-            wake_up_interruptible_sync(&this->wq);
-            result = wait_event_interruptible(this->rq, (this->rhead != this->whead) );
-            if( result != 0 )
-                return result;
-        }
+    while( count > 0 && this->len_remaining != 0 ){
+        if( !block && this->rhead == this->whead )
+            result = -EAGAIN;
+        else
+            result = wait_for_data(this, 1);
+        // a stream reader keeps what it already has
+        if( result != 0 && bytes_read > 0 )
+            break;
+        if( result != 0 )
+            return result;
 
         //we can read all the way to whead, circularly
         head_space = circ_head_space(this->rhead, this->whead, this->SIZE);
         to_bb_end = this->SIZE-(this->rhead-this->cbuf);
-        to_read = _min(head_space, _min(to_bb_end, _min(len, count)));
-        copy_to_user(buf+bytes_read, this->rhead, to_read);
+        to_read = _min(head_space, _min(to_bb_end, _min(this->len_remaining, count)));
+        if( copy_to_user(buf+bytes_read, this->rhead, to_read) ){
+            if( bytes_read > 0 )
+                break;
+            return -EFAULT;
+        }
+        if( this->frame_flags & FRAME_CRC )
+            this->frame_crc = crc32c(this->frame_crc, this->rhead, to_read);
         this->rhead = circ_buf_offset(this->rhead, this->cbuf, to_read, this->SIZE);
+        // kept in step so that staging can take over part way through
+        this->stored_got += to_read;
         bytes_read += to_read;
-        len -= to_read;
+        this->len_remaining -= to_read;
         count -= to_read;
-    }while( count > 0 && len != 0 );
-
-    if( len == 0 ){
-        this->message_complete = 1;
     }
 
-    this->len_remaining = len;
+    if( this->len_remaining == 0 ){
+        result = verify_frame(this, block);
+        if( result == -EBADMSG )
+            close_frame(this);
+        // interrupted or not waiting for the trailer; it's checked next read
+        if( result != 0 && result != -EBADMSG && bytes_read > 0 )
+            return bytes_read;
+        if( result != 0 )
+            return result;
+        // the message has now been dequeued in full
+        if( this->frame_flags & FRAME_TSTAMP )
+            record_latency(this, this->frame_stamp);
+        close_frame(this);
+        // message mode readers know the length up front; skip the empty read
+        if( !di->msgmode && bytes_read > 0 )
+            this->message_complete = 1;
+    }
 
     wake_up_interruptible_sync(&this->wq);
 
-    *ppos = (this->rhead-this->cbuf);
     return bytes_read;
 }
 
-static ssize_t ipcdevice_write(struct file *filp, const char __user *buf,
+static ssize_t ipcdevice_read(struct file *filp, char __user *buf,
         size_t count, loff_t *ppos){
+    ssize_t result;
+    struct duplexinfo *di = filp->private_data;
+    struct simplexinfo *this = di->r;
+    int block = !(filp->f_flags & O_NONBLOCK);
+
+    // an overwriting writer must not move rhead out from under us
+    if( !block && !mutex_trylock(&this->rlock) )
+        return -EAGAIN;
+    if( block && mutex_lock_interruptible(&this->rlock) )
+        return -ERESTARTSYS;
+    result = read_frame(di, buf, count, block);
+    mutex_unlock(&this->rlock);
+
+    *ppos = (this->rhead-this->cbuf);
+    return result;
+}
+
+/*
+ * Write path for messages that are staged in kernel memory before they go
+ * into the cbuf: all but the shortest messages on a compressed channel,
+ * and large transformed messages whose encoding is farmed out across CPUs.
+ * The frame is only published once the whole message is ready.  Compressed
+ * messages that don't shrink are stored as they are, so the reader never
+ * pays to inflate them.
+ */
+int write_staged(struct duplexinfo *di, const char __user *buf, size_t count){
+    struct simplexinfo *this = di->w;
+    size_t output_length = transformed_length(di, count);
+    char *raw = NULL, *plain = NULL, *packed = NULL;
+    int packed_len = 0;
+    int result = 0;
+    size_t word = frame_flags(di);
+    u32 crc = ~0;
+    u32 *crc_p = (word & FRAME_CRC) ? &crc : NULL;
+
+    if( output_length < count || output_length > FRAME_LEN_MASK )
+        return -EMSGSIZE;
+
+    raw = kvmalloc(count, GFP_KERNEL);
+    if( raw == NULL )
+        return -ENOMEM;
+    if( copy_from_user(raw, buf, count) ){
+        result = -EFAULT;
+        goto out;
+    }
+
+    plain = raw;
+    if( di->rot || di->reverse || di->base64 ){
+        plain = kvmalloc(output_length, GFP_KERNEL);
+        if( plain == NULL ){
+            result = -ENOMEM;
+            goto out;
+        }
+        transform_staged(di, raw, count, plain);
+    }
+
+    if( di->lz4 )
+        packed = kvmalloc(LZ4_compressBound(output_length), GFP_KERNEL);
+    if( packed != NULL ){
+        packed_len = LZ4_compress_default(plain, packed, output_length,
+            LZ4_compressBound(output_length), this->lz4_wrkmem);
+    }
+
+    if( packed_len > 0 && packed_len + 4 < output_length )
+        word |= FRAME_LZ4 | packed_len;
+    else
+        word |= output_length;
+    if( di->overwrite ){
+        result = make_room(this, word);
+        if( result != 0 ){
+            // discarded, which overwrite mode counts as sent
+            if( result == -ENOBUFS )
+                result = 0;
+            goto out;
+        }
+    }
+
+    result = put_header(di, word, output_length);
+    if( result == 0 && (word & FRAME_LZ4) )
+        result = circ_put_bytes(this, packed, packed_len, crc_p);
+    else if( result == 0 )
+        result = circ_put_bytes(this, plain, output_length, crc_p);
+    if( result == 0 && crc_p != NULL )
+        result = put_trailer(this, crc);
+
+    wake_reader(di);
+
+out:
+    if( packed != NULL )
+        kvfree(packed);
+    if( plain != raw )
+        kvfree(plain);
+    kvfree(raw);
+    return result;
+}
+
+ssize_t write_frame(struct duplexinfo *di, const char __user *buf, size_t count){
     size_t chunks_to_write = 0, head_space = 0, written = 0;
     int result = 0;
-    struct duplexinfo *di = filp->private_data;
     struct simplexinfo *this = di->w;
     long rot = di->rot;
     long reverse = di->reverse;
     long base64 = di->base64;
+    long integrity = di->crc;
+    u32 crc = ~0;
     int incr = 1;
     const char __user *buf_curs = buf;
     char *wh_curs;
     char cur_char = 0;
     int in_chunk_size = 1, out_chunk_size = 1;
     int in_chunk_iter;
+    int faulted = 0;
     size_t output_length = count;
     union base64_translator trans;
 
-    if( this->rhead != this->whead && circ_head_space(this->whead, this->rhead, this->SIZE) < 5){
-        wake_up_interruptible_sync(&this->rq);
-        result = wait_event_interruptible(this->wq,
-            ( circ_head_space(this->rhead, this->whead, this->SIZE) >= 5) );
-        if( result != 0 )
+    if( count > 0 && ((di->lz4 && count >= LZ4_THRESHOLD) ||
+            (count >= PARALLEL_THRESHOLD && (rot || reverse || base64))) ){
+        result = write_staged(di, buf, count);
+        if( result < 0 )
             return result;
+        return count;
     }
 
     if( base64 ){
         in_chunk_size = 3;
         out_chunk_size = 4;
-        output_length = (count/in_chunk_size + !!(count%in_chunk_size))*out_chunk_size;
+        output_length = transformed_length(di, count);
         if( output_length < count ) // output_length will overflow if count > 3GB
             return -EFAULT;
     }
+    if( output_length > FRAME_LEN_MASK )
+        return -EMSGSIZE;
+    // before anything is dropped for it or its header goes out
+    if (!access_ok(VERIFY_READ, buf, count))
+        return -EFAULT;
+
+    if( di->overwrite ){
+        result = make_room(this, output_length | frame_flags(di));
+        // discarded, which overwrite mode counts as sent
+        if( result == -ENOBUFS )
+            return count;
+        if( result != 0 )
+            return result;
+    }
 
-    put_length(&this->whead, this->cbuf, this->SIZE, output_length);
+    result = put_header(di, output_length | frame_flags(di), output_length);
+    if( result != 0 )
+        return result;
 
     if( reverse ){
         buf_curs = buf+count-1;
         incr = -1;
     }
-    if (!access_ok(VERIFY_READ, buf, count))
-        return -EFAULT;
     while( count > 0 ){
         if( this->rhead != this->whead && circ_head_space(this->whead, this->rhead, this->SIZE) <= out_chunk_size){
             wake_up_interruptible_sync(&this->rq);
@@ -286,44 +1240,75 @@ static ssize_t ipcdevice_write(struct file *filp, const char __user *buf,
 
         for(wh_curs = this->whead; circ_head_space(this->whead, wh_curs, this->SIZE) < chunks_to_write*out_chunk_size; output_length-=out_chunk_size){
             for(in_chunk_iter = in_chunk_size-1; in_chunk_iter >= 0 && count != 0; --in_chunk_iter, buf_curs+=incr, --count, ++written){
-                if(__get_user( cur_char, buf_curs))
-                    return -EFAULT;
+                // the header is already out, so pad the frame to keep the
+                // ring in step; the reader gets zeros (and a bad CRC)
+                if( faulted || __get_user( cur_char, buf_curs) ){
+                    faulted = 1;
+                    cur_char = 0;
+                }
                 if( rot ){
-                    if( cur_char >= 'A' && cur_char <= 'Z' )
-                        cur_char = 'A' + ((cur_char - 'A' + 13)%26);
-                    else if( cur_char >= 'a' && cur_char <= 'z' )
-                        cur_char = 'a' + ((cur_char - 'a' + 13)%26);
+                    cur_char = rot13(cur_char);
                 }
                 if( base64 ){
                     trans.input[in_chunk_iter] = cur_char;
                 }
             }
             if( base64 ){
-                *(wh_curs+0) = base64_table[trans.f1];
-                *(wh_curs+1) = base64_table[trans.f2];
-                *(wh_curs+2) = base64_table[trans.f3];
-                *(wh_curs+3) = base64_table[trans.f4];
+                // frames aren't 4 byte aligned, so a group may wrap
+                *wh_curs = base64_table[trans.f1];
+                *circ_buf_offset(wh_curs, this->cbuf, 1, this->SIZE) = base64_table[trans.f2];
+                *circ_buf_offset(wh_curs, this->cbuf, 2, this->SIZE) = base64_table[trans.f3];
+                *circ_buf_offset(wh_curs, this->cbuf, 3, this->SIZE) = base64_table[trans.f4];
                 trans.input[0] = trans.input[1] = trans.input[2] = 0;
                 for(; in_chunk_iter >= 0; --in_chunk_iter){
-                    *(wh_curs+3-in_chunk_iter) = '=';
+                    *circ_buf_offset(wh_curs, this->cbuf, 3-in_chunk_iter, this->SIZE) = '=';
                 }
             } else {
                 *wh_curs = cur_char;
             }
             wh_curs = circ_buf_offset(wh_curs, this->cbuf, out_chunk_size, this->SIZE);
         }
+        // checksum each pass while it is still hot in the cache
+        if( integrity )
+            crc = circ_crc32c(crc, this, this->whead, chunks_to_write*out_chunk_size);
         this->whead = wh_curs;
     }
 
-    wake_up_interruptible_sync(&this->rq);
+    if( integrity ){
+        result = put_trailer(this, faulted ? ~crc : crc);
+        if( result != 0 )
+            return result;
+    }
 
-    *ppos = (this->whead-this->cbuf);
+    wake_reader(di);
+
+    if( faulted )
+        return -EFAULT;
     return written;
 }
 
+static ssize_t ipcdevice_write(struct file *filp, const char __user *buf,
+        size_t count, loff_t *ppos){
+    ssize_t result;
+    struct duplexinfo *di = filp->private_data;
+    struct simplexinfo *this = di->w;
+    u64 stamp = di->capture ? ktime_get_ns() : 0;
+
+    result = write_frame(di, buf, count);
+    if( result >= 0 && di->capture )
+        capture_message(di, buf, count, stamp);
+
+    *ppos = (this->whead-this->cbuf);
+    return result;
+}
+
 long ipcdevice_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
     struct duplexinfo *di = filp->private_data;
+    struct ipc_type_filter filter;
+    struct ipc_drop_stats dropped;
+    size_t len;
+    int result;
 
     switch( cmd ){
     case IPC_IOC_ROT13:
@@ -338,6 +1323,91 @@ long ipcdevice_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long
         di->reverse = !!arg;
         break;
 
+    case IPC_IOC_LZ4:
+        di->lz4 = !!arg;
+        break;
+
+    case IPC_IOC_CRC32C:
+        di->crc = !!arg;
+        break;
+
+    case IPC_IOC_LATENCY:
+        di->latency = !!arg;
+        break;
+
+    case IPC_IOC_LATHIST:
+        if( copy_to_user((void __user *)arg, &di->r->lat_hist, sizeof(di->r->lat_hist)) )
+            return -EFAULT;
+        break;
+
+    case IPC_IOC_LATRESET:
+        memset(&di->r->lat_hist, 0, sizeof(di->r->lat_hist));
+        break;
+
+    case IPC_IOC_MSGMODE:
+        di->msgmode = !!arg;
+        break;
+
+    case FIONREAD:
+        // a reader in the middle of a read holds rlock; don't wait for it
+        if( !mutex_trylock(&di->r->rlock) )
+            return put_user(0, (int __user *)arg);
+        result = next_frame(di->r, 0);
+        len = di->r->len_remaining;
+        mutex_unlock(&di->r->rlock);
+        if( result == -EAGAIN )
+            return put_user(0, (int __user *)arg);
+        if( result != 0 )
+            return result;
+        return put_user(len, (int __user *)arg);
+
+    case IPC_IOC_PEEKLEN:
+        if( mutex_lock_interruptible(&di->r->rlock) )
+            return -ERESTARTSYS;
+        result = next_frame(di->r, 1);
+        len = di->r->len_remaining;
+        mutex_unlock(&di->r->rlock);
+        if( result != 0 )
+            return result;
+        return put_user(len, (int __user *)arg);
+
+    case IPC_IOC_MSGTYPE:
+        di->mtype = (u32)arg;
+        break;
+
+    case IPC_IOC_FILTER:
+        if( copy_from_user(&filter, (void __user *)arg, sizeof(filter)) )
+            return -EFAULT;
+        // an empty range would silently throw away everything
+        if( filter.min > filter.max )
+            return -EINVAL;
+        if( mutex_lock_interruptible(&di->r->rlock) )
+            return -ERESTARTSYS;
+        di->r->filter = filter;
+        mutex_unlock(&di->r->rlock);
+        break;
+
+    case IPC_IOC_OVERWRITE:
+        di->overwrite = !!arg;
+        break;
+
+    case IPC_IOC_DROPPED:
+        spin_lock(&di->r->drop_lock);
+        dropped = di->r->dropped;
+        memset(&di->r->dropped, 0, sizeof(di->r->dropped));
+        spin_unlock(&di->r->drop_lock);
+        if( copy_to_user((void __user *)arg, &dropped, sizeof(dropped)) )
+            return -EFAULT;
+        break;
+
+    case IPC_IOC_CAPTURE:
+        di->capture = !!arg;
+        break;
+
+    case IPC_IOC_SNAPLEN:
+        di->snaplen = min_t(unsigned long, arg, CAPTURE_SNAPLEN_MAX);
+        break;
+
     default:
         return -ENOTTY;
     }
@@ -360,13 +1430,27 @@ int __init ipcdevice_init(void){
         goto teardown_sib;
     }
 
+    ipc_wq = alloc_workqueue(IPC_NAME, WQ_UNBOUND, 0);
+    if( ipc_wq == NULL ){
+        printk( KERN_ERR "ipcdevice: error creating workqueue.\n" );
+        result = -ENOMEM;
+        goto teardown_sib;
+    }
+
+    cap_buf = vmalloc(CAPTURE_SIZE);
+    if( cap_buf == NULL ){
+        printk( KERN_ERR "ipcdevice: error allocating capture ring.\n" );
+        result = -ENOMEM;
+        goto teardown_wq;
+    }
+
     cdev_init(&ipc_cdev, &ipcdevice_fops);
     ipc_cdev.owner = THIS_MODULE;
     result = cdev_add(&ipc_cdev, MKDEV(IPC_MAJOR, 0), 1);
     if( result < 0 ){
         printk( KERN_ERR "ipcdevice: error registering major number %d\n",
             IPC_MAJOR );
-        goto teardown_sib;
+        goto teardown_cap;
     }
 
     ipc_class = class_create(THIS_MODULE, IPC_NAME);
@@ -383,6 +1467,13 @@ int __init ipcdevice_init(void){
         goto teardown_class;
     }
 
+    // capture is a diagnostic; the device works without debugfs
+    ipc_debugfs = debugfs_create_dir(IPC_NAME, NULL);
+    if( !IS_ERR_OR_NULL(ipc_debugfs) ){
+        debugfs_create_file("capture", 0400, ipc_debugfs, NULL, &capture_fops);
+        debugfs_create_u64("capture_lost", 0400, ipc_debugfs, &cap_lost);
+    }
+
     printk( KERN_INFO "ipcdevice: module installed.\n");
     return 0;
 
@@ -390,6 +1481,10 @@ teardown_class:
     class_destroy(ipc_class);
 teardown_cdev:
     cdev_del(&ipc_cdev);
+teardown_cap:
+    vfree(cap_buf);
+teardown_wq:
+    destroy_workqueue(ipc_wq);
 teardown_sib:
     simplexinfo_destroy(&b);
 teardown_sia:
@@ -398,9 +1493,12 @@ teardown_sia:
 }
 
 void __exit ipcdevice_exit(void){
+    debugfs_remove_recursive(ipc_debugfs);
     device_destroy( ipc_class, MKDEV(IPC_MAJOR, 0) );
     class_destroy( ipc_class );
     cdev_del(&ipc_cdev);
+    vfree(cap_buf);
+    destroy_workqueue(ipc_wq);
     simplexinfo_destroy(&a);
     simplexinfo_destroy(&b);
 }
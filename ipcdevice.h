@@ -7,6 +7,84 @@
 #define IPC_IOC_ROT13   _IOW('i', 0x70, int)
 #define IPC_IOC_BASE64  _IOW('i', 0x71, int)
 #define IPC_IOC_REVERSE _IOW('i', 0x72, int)
+/* length of the next message, without consuming it; blocks until one arrives.
+ * FIONREAD reports the same, but returns 0 rather than blocking, including
+ * while another read on this end is in progress. */
+#define IPC_IOC_PEEKLEN _IOR('i', 0x73, int)
+/* deliver each message in a single read with no trailing zero-length read;
+ * reads too small to hold the whole message fail with EMSGSIZE. */
+#define IPC_IOC_MSGMODE _IOW('i', 0x74, int)
+/* LZ4 compress messages in the ring; readers see the original bytes. */
+#define IPC_IOC_LZ4     _IOW('i', 0x75, int)
+/* append a CRC32C to each message; readers fail with EBADMSG on mismatch. */
+#define IPC_IOC_CRC32C  _IOW('i', 0x76, int)
+
+/* bucket i counts messages that sat in the ring for [2^(i-1), 2^i) ns;
+ * bucket 0 is under 1ns and the last bucket takes everything longer. */
+#define IPC_LAT_BUCKETS 32
+struct ipc_lat_hist{
+    __u64 count[IPC_LAT_BUCKETS];
+};
+
+/* timestamp messages sent on this end to feed the reader's histogram */
+#define IPC_IOC_LATENCY  _IOW('i', 0x77, int)
+/* copy out / clear the histogram for messages received on this end */
+#define IPC_IOC_LATHIST  _IOR('i', 0x78, struct ipc_lat_hist)
+#define IPC_IOC_LATRESET _IO('i', 0x79)
+
+/* messages discarded to make room in overwrite mode, and their payload bytes
+ * as stored in the ring */
+struct ipc_drop_stats{
+    __u64 messages;
+    __u64 bytes;
+};
+
+/* never block sending on this end: when the ring is full, discard the oldest
+ * messages instead, or the new one if the reader is busy taking a message
+ * out.  Messages must then fit in the ring, or fail with EMSGSIZE. */
+#define IPC_IOC_OVERWRITE _IOW('i', 0x7a, int)
+/* copy out, and clear, the drop counts for messages bound for this end */
+#define IPC_IOC_DROPPED   _IOR('i', 0x7b, struct ipc_drop_stats)
+
+/* only messages with min <= type <= max are delivered; the rest are
+ * discarded in the kernel.  Untyped messages have type 0. */
+struct ipc_type_filter{
+    __u32 min;
+    __u32 max;
+};
+
+/* type to tag messages sent on this end with; 0 leaves them untyped */
+#define IPC_IOC_MSGTYPE _IOW('i', 0x7c, int)
+/* set the type filter for messages received on this end; fails with EINVAL
+ * if min > max */
+#define IPC_IOC_FILTER  _IOW('i', 0x7d, struct ipc_type_filter)
+
+/* a capture record, as read from <debugfs>/ipcdevice/capture.  There is one
+ * per message sent on an end with capture on, followed by the first
+ * captured bytes of the message as the sender wrote them. */
+struct ipc_capture_record{
+    __u64 tstamp;     /* ktime_get_ns() when the write started */
+    __u32 length;     /* bytes the sender wrote */
+    __u32 captured;   /* payload bytes following the record */
+    __u32 type;       /* message type, 0 if untyped */
+    __u16 direction;  /* 0 if sent on the end opened first, 1 otherwise */
+    __u16 transforms; /* IPC_CAP_* */
+};
+
+/* the sender's options; these match libipcdevice's IPC_XF_* masks */
+#define IPC_CAP_ROT13     0x01
+#define IPC_CAP_BASE64    0x02
+#define IPC_CAP_REVERSE   0x04
+#define IPC_CAP_LZ4       0x08
+#define IPC_CAP_CRC32C    0x10
+#define IPC_CAP_LATENCY   0x20
+#define IPC_CAP_OVERWRITE 0x40
+
+/* record every message sent on this end in the capture ring.  Records are
+ * dropped, not waited for, when the tap reader falls behind. */
+#define IPC_IOC_CAPTURE _IOW('i', 0x7e, int)
+/* also capture up to this many leading payload bytes of each message */
+#define IPC_IOC_SNAPLEN _IOW('i', 0x7f, int)
 
 #define IPC_ENABLE 1
 #define IPC_DISABLE 0
@@ -0,0 +1,185 @@
+/*
+ * libipcdevice, a message-oriented client library for the ipcdevice module.
+ * Copyright (C) 2012  Nate Bragg
+ * 
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "libipcdevice.h"
+
+#define IPC_PATH "/dev/ipcdevice"
+
+// glibc only defines it for X/Open; Linux's limit has always been 1024
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+int ipc_open_channel(void){
+    int fd = open(IPC_PATH, O_RDWR);
+    if( fd == -1 )
+        return -1;
+    if( ioctl(fd, IPC_IOC_MSGMODE, IPC_ENABLE) == -1 ){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int ipc_close_channel(int fd){
+    return close(fd);
+}
+
+ssize_t ipc_send(int fd, const void *msg, size_t len){
+    // a message is exactly one write; never split or retry it
+    return write(fd, msg, len);
+}
+
+ssize_t ipc_recv(int fd, void *buf, size_t len){
+    ssize_t result;
+    do{
+        result = read(fd, buf, len);
+    }while( result == -1 && errno == EINTR );
+    return result;
+}
+
+ssize_t ipc_recv_alloc(int fd, void **msg){
+    ssize_t len, result;
+
+    // in overwrite mode the peeked message may be gone by the time it is
+    // read, and the next one bigger; size the buffer again
+    do{
+        *msg = NULL;
+        len = ipc_peek_len(fd);
+        if( len == -1 )
+            return -1;
+
+        // malloc(0) may return NULL; always hand back something freeable
+        *msg = malloc(len ? len : 1);
+        if( *msg == NULL )
+            return -1;
+
+        result = ipc_recv(fd, *msg, len);
+        if( result == -1 ){
+            free(*msg);
+            *msg = NULL;
+        }
+    }while( result == -1 && errno == EMSGSIZE );
+    return result;
+}
+
+int ipc_send_batch(int fd, const struct iovec *msgs, int cnt){
+    int i = 0, n, run;
+    ssize_t result;
+
+    while( i < cnt ){
+        // writev passes over empty iovecs, but they are messages too
+        if( msgs[i].iov_len == 0 ){
+            if( ipc_send(fd, msgs[i].iov_base, 0) == -1 )
+                break;
+            i++;
+            continue;
+        }
+        for(run = 0; i+run < cnt && run < IOV_MAX && msgs[i+run].iov_len > 0; run++);
+
+        // the device writes each iovec as a message of its own, stopping at
+        // the first that fails
+        result = writev(fd, msgs+i, run);
+        if( result == -1 )
+            break;
+        for(n = 0; n < run && (size_t)result >= msgs[i+n].iov_len; n++)
+            result -= msgs[i+n].iov_len;
+        i += n;
+        if( n < run )
+            break;
+    }
+    return i ? i : -1;
+}
+
+int ipc_recv_batch(int fd, struct iovec *msgs, int cnt){
+    int i, flags = -1;
+    ssize_t result;
+    for(i = 0; i < cnt; i++){
+        result = ipc_recv(fd, msgs[i].iov_base, msgs[i].iov_len);
+        if( result == -1 )
+            break;
+        msgs[i].iov_len = result;
+        // only block for the first message; take the rest as they're ready,
+        // stopping at EAGAIN
+        if( i == 0 && cnt > 1 ){
+            flags = fcntl(fd, F_GETFL);
+            if( flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1 ){
+                flags = -1;
+                i++;
+                break;
+            }
+        }
+    }
+    if( flags != -1 )
+        fcntl(fd, F_SETFL, flags);
+    return i ? i : -1;
+}
+
+int ipc_set_transforms(int fd, int mask){
+    if( ioctl(fd, IPC_IOC_ROT13, !!(mask & IPC_XF_ROT13)) == -1 ||
+        ioctl(fd, IPC_IOC_BASE64, !!(mask & IPC_XF_BASE64)) == -1 ||
+        ioctl(fd, IPC_IOC_REVERSE, !!(mask & IPC_XF_REVERSE)) == -1 ||
+        ioctl(fd, IPC_IOC_LZ4, !!(mask & IPC_XF_LZ4)) == -1 ||
+        ioctl(fd, IPC_IOC_CRC32C, !!(mask & IPC_XF_CRC32C)) == -1 ||
+        ioctl(fd, IPC_IOC_LATENCY, !!(mask & IPC_XF_LATENCY)) == -1 ||
+        ioctl(fd, IPC_IOC_OVERWRITE, !!(mask & IPC_XF_OVERWRITE)) == -1 )
+        return -1;
+    return 0;
+}
+
+int ipc_set_type(int fd, unsigned int type){
+    return ioctl(fd, IPC_IOC_MSGTYPE, type);
+}
+
+int ipc_set_filter(int fd, unsigned int min, unsigned int max){
+    struct ipc_type_filter filter = { .min = min, .max = max };
+    return ioctl(fd, IPC_IOC_FILTER, &filter);
+}
+
+ssize_t ipc_peek_len(int fd){
+    int len = 0;
+    if( ioctl(fd, IPC_IOC_PEEKLEN, &len) == -1 )
+        return -1;
+    return len;
+}
+
+ssize_t ipc_pending(int fd){
+    int len = 0;
+    if( ioctl(fd, FIONREAD, &len) == -1 )
+        return -1;
+    return len;
+}
+
+int ipc_latency_hist(int fd, struct ipc_lat_hist *hist){
+    return ioctl(fd, IPC_IOC_LATHIST, hist);
+}
+
+int ipc_latency_reset(int fd){
+    return ioctl(fd, IPC_IOC_LATRESET);
+}
+
+int ipc_dropped(int fd, struct ipc_drop_stats *stats){
+    return ioctl(fd, IPC_IOC_DROPPED, stats);
+}
@@ -0,0 +1,75 @@
+#ifndef __libipcdevice_h
+#define __libipcdevice_h
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "ipcdevice.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* transforms and per-message options, for ipc_set_transforms */
+#define IPC_XF_ROT13   0x01
+#define IPC_XF_BASE64  0x02
+#define IPC_XF_REVERSE 0x04
+#define IPC_XF_LZ4     0x08
+#define IPC_XF_CRC32C  0x10
+#define IPC_XF_LATENCY 0x20
+#define IPC_XF_OVERWRITE 0x40
+
+/* where the capture ring's tap reader lives, with debugfs mounted */
+#define IPC_CAPTURE_PATH "/sys/kernel/debug/ipcdevice/capture"
+
+/* open an end of the device with message mode on; returns an fd or -1 */
+int ipc_open_channel(void);
+int ipc_close_channel(int fd);
+
+/* send one message; returns the bytes sent or -1 */
+ssize_t ipc_send(int fd, const void *msg, size_t len);
+/* receive one whole message into buf; fails with EMSGSIZE if it won't fit */
+ssize_t ipc_recv(int fd, void *buf, size_t len);
+/* receive one whole message into a buffer malloc'd to its exact size,
+   sizing it again if the message is overwritten before it is read */
+ssize_t ipc_recv_alloc(int fd, void **msg);
+
+/* send/receive up to cnt messages, one per iovec; returns the number of
+ * messages transferred, or -1 if the first one failed.  ipc_send_batch sends
+ * runs of non-empty messages with a single writev.  ipc_recv_batch only
+ * waits for the first message, and sets each iov_len to the length of the
+ * message received into it.
+ *
+ * ipc_recv_batch gets the rest of the batch by setting O_NONBLOCK on fd for
+ * the duration, which affects every fd sharing its open file description.
+ * Don't use it while another thread or a forked child is using the same
+ * end, and expect O_NONBLOCK to still be set if the process dies mid-batch. */
+int ipc_send_batch(int fd, const struct iovec *msgs, int cnt);
+int ipc_recv_batch(int fd, struct iovec *msgs, int cnt);
+
+/* enable exactly the transforms in the IPC_XF_* mask for messages sent on fd */
+int ipc_set_transforms(int fd, int mask);
+
+/* tag messages sent on fd with type (0 for untyped), and only receive
+ * messages on fd whose type is in [min, max] */
+int ipc_set_type(int fd, unsigned int type);
+int ipc_set_filter(int fd, unsigned int min, unsigned int max);
+
+/* length of the next message; ipc_peek_len blocks until one arrives,
+ * ipc_pending returns 0 instead */
+ssize_t ipc_peek_len(int fd);
+ssize_t ipc_pending(int fd);
+
+/* queueing delay histogram for messages received on fd */
+int ipc_latency_hist(int fd, struct ipc_lat_hist *hist);
+int ipc_latency_reset(int fd);
+
+/* messages bound for fd that an overwriting sender discarded since the last
+ * call */
+int ipc_dropped(int fd, struct ipc_drop_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __libipcdevice_h */
@@ -0,0 +1,44 @@
+#ifndef __reference_h
+#define __reference_h
+
+#include <stddef.h>
+
+#include "libipcdevice.h"
+
+/*
+ * What the driver should deliver for len bytes of src sent with the
+ * IPC_XF_* transforms in mask; returns the length written to dst.
+ */
+static size_t reference_transform(const char *src, size_t len, int mask, char *dst){
+    static const char table[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    unsigned char in[3];
+    size_t i, j, out = 0;
+    char c;
+
+    for(i = 0; i < len; i += 3){
+        for(j = 0; j < 3; j++){
+            if( i+j >= len ){
+                in[j] = 0;
+                continue;
+            }
+            c = src[(mask & IPC_XF_REVERSE) ? len-1-(i+j) : i+j];
+            if( (mask & IPC_XF_ROT13) && c >= 'A' && c <= 'Z' )
+                c = 'A' + (c - 'A' + 13)%26;
+            else if( (mask & IPC_XF_ROT13) && c >= 'a' && c <= 'z' )
+                c = 'a' + (c - 'a' + 13)%26;
+            in[j] = c;
+            if( !(mask & IPC_XF_BASE64) )
+                dst[out++] = c;
+        }
+        if( mask & IPC_XF_BASE64 ){
+            dst[out++] = table[in[0] >> 2];
+            dst[out++] = table[((in[0] & 0x03) << 4) | (in[1] >> 4)];
+            dst[out++] = i+1 < len ? table[((in[1] & 0x0F) << 2) | (in[2] >> 6)] : '=';
+            dst[out++] = i+2 < len ? table[in[2] & 0x3F] : '=';
+        }
+    }
+    return out;
+}
+
+#endif /* __reference_h */
@@ -0,0 +1,320 @@
+/*
+ * replay, a capture tap and traffic replayer for the ipcdevice module.
+ * Copyright (C) 2012  Nate Bragg
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ *
+ * With -t, drain the module's capture ring into a file for a while.
+ * Otherwise, replay such a file against the device: each direction's
+ * messages are sent on their own end with the transforms and type they were
+ * captured with, on the captured schedule sped up by the -x factor (0 sends
+ * as fast as possible), while a reader on the other end drains them.
+ * Payload bytes that weren't captured are filled with text.
+ */
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "libipcdevice.h"
+
+#define PROC_NAME "replay"
+#define CAPTURE_LOST_PATH "/sys/kernel/debug/ipcdevice/capture_lost"
+
+int tap_seconds = 0;
+double scale = 1.0;
+
+struct entry{
+    struct ipc_capture_record rec;
+    char *payload;
+};
+
+struct entry *entries = NULL;
+size_t n_entries = 0;
+size_t max_length = 0;
+uint64_t first_tstamp = UINT64_MAX;
+double start;
+
+double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+void sleep_until(double t){
+    struct timespec ts;
+    ts.tv_sec = (time_t)t;
+    ts.tv_nsec = (long)((t - ts.tv_sec)*1e9);
+    while( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0 );
+}
+
+/*
+ * Copy the capture ring into file_name for tap_seconds.  The ring reads as
+ * empty rather than blocking, so poll it.
+ */
+int tap(const char *file_name){
+    char buf[64*1024];
+    ssize_t bytes_read;
+    FILE *out = NULL, *lost = NULL;
+    unsigned long long lost_count = 0;
+    size_t total = 0;
+    double end;
+    int capture;
+
+    capture = open(IPC_CAPTURE_PATH, O_RDONLY);
+    if( capture == -1 ){
+        printf( PROC_NAME ": could not open " IPC_CAPTURE_PATH "!\n");
+        return 1;
+    }
+    out = fopen(file_name, "w");
+    if( out == NULL ){
+        printf( PROC_NAME ": could not open %s!\n", file_name);
+        close(capture);
+        return 1;
+    }
+
+    end = now() + tap_seconds;
+    while( now() < end ){
+        bytes_read = read(capture, buf, sizeof(buf));
+        if( bytes_read == -1 ){
+            printf( PROC_NAME ": could not read the capture ring!\n");
+            break;
+        }
+        if( bytes_read == 0 ){
+            usleep(10000);
+            continue;
+        }
+        fwrite(buf, 1, bytes_read, out);
+        total += bytes_read;
+    }
+
+    lost = fopen(CAPTURE_LOST_PATH, "r");
+    if( lost != NULL ){
+        if( fscanf(lost, "%llu", &lost_count) != 1 )
+            lost_count = 0;
+        fclose(lost);
+    }
+    printf( PROC_NAME ": captured %zu bytes; %llu records lost so far\n",
+        total, lost_count );
+
+    fclose(out);
+    close(capture);
+    return 0;
+}
+
+int load(const char *file_name){
+    FILE *in = NULL;
+    struct ipc_capture_record rec;
+    size_t allocated = 0;
+
+    in = fopen(file_name, "r");
+    if( in == NULL ){
+        printf( PROC_NAME ": could not open %s!\n", file_name);
+        return 1;
+    }
+    while( fread(&rec, sizeof(rec), 1, in) == 1 ){
+        if( n_entries == allocated ){
+            allocated = allocated ? allocated*2 : 256;
+            entries = realloc(entries, allocated*sizeof(*entries));
+        }
+        entries[n_entries].rec = rec;
+        entries[n_entries].payload = malloc(rec.captured + 1);
+        if( fread(entries[n_entries].payload, 1, rec.captured, in) != rec.captured ){
+            printf( PROC_NAME ": %s is truncated!\n", file_name);
+            fclose(in);
+            return 1;
+        }
+        if( rec.length > max_length )
+            max_length = rec.length;
+        // records are appended as writes finish, so can be slightly out of order
+        if( rec.tstamp < first_tstamp )
+            first_tstamp = rec.tstamp;
+        n_entries++;
+    }
+    fclose(in);
+    return 0;
+}
+
+/*
+ * Send every captured message that went in direction on ipc, keeping to the
+ * captured schedule.
+ */
+int sender(int ipc, int direction){
+    static const char words[] = "lorem ipsum dolor sit amet, consectetur adipiscing elit ";
+    char *body = NULL;
+    struct ipc_capture_record *rec;
+    int mask = -1;
+    unsigned int type = 0;
+    size_t i, j, count = 0, total_bytes = 0, late = 0;
+    double due;
+    ssize_t bytes_written;
+
+    body = malloc(max_length + 1);
+    for(i = 0; i < n_entries; i++){
+        rec = &entries[i].rec;
+        if( rec->direction != direction )
+            continue;
+
+        memcpy(body, entries[i].payload, rec->captured);
+        for(j = rec->captured; j < rec->length; j++)
+            body[j] = words[j % (sizeof(words)-1)];
+        if( rec->transforms != mask ){
+            mask = rec->transforms;
+            ipc_set_transforms(ipc, mask);
+        }
+        if( rec->type != type ){
+            type = rec->type;
+            ipc_set_type(ipc, type);
+        }
+
+        if( scale > 0 ){
+            due = start + (rec->tstamp - first_tstamp)/1e9/scale;
+            if( now() > due + 0.001 )
+                late++;
+            sleep_until(due);
+        }
+        bytes_written = ipc_send(ipc, body, rec->length);
+        if( bytes_written != rec->length ){
+            printf( PROC_NAME ": trouble replaying %u byte message: only wrote %zd"
+                " bytes.\n", rec->length, bytes_written);
+            free(body);
+            return 1;
+        }
+        count++;
+        total_bytes += rec->length;
+    }
+
+    printf( PROC_NAME ": direction %d: %zu messages, %zu bytes in %.3fs, %zu more"
+        " than 1ms late\n", direction, count, total_bytes, now() - start, late );
+    free(body);
+    return 0;
+}
+
+/*
+ * Read back everything sent in direction.  In overwrite mode some of it
+ * may never arrive, so dropped messages count too.
+ */
+int drainer(int ipc, int direction){
+    struct ipc_drop_stats dropped;
+    size_t i, expected = 0, received = 0, lost = 0;
+    void *msg;
+
+    for(i = 0; i < n_entries; i++)
+        expected += entries[i].rec.direction == direction;
+
+    while( 1 ){
+        if( ipc_dropped(ipc, &dropped) == 0 )
+            lost += dropped.messages;
+        if( received + lost >= expected )
+            break;
+        if( ipc_recv_alloc(ipc, &msg) == -1 ){
+            printf( PROC_NAME ": could not read message %zu!\n", received);
+            return 1;
+        }
+        free(msg);
+        received++;
+    }
+    if( lost > 0 )
+        printf( PROC_NAME ": direction %d: %zu messages overwritten\n", direction, lost );
+    return 0;
+}
+
+int replay(void){
+    int ipc[2];
+    pid_t pids[4];
+    int i, j, status = 0, result = 0;
+
+    // the end opened first sends direction 0, so the replay keeps the roles
+    ipc[0] = ipc_open_channel();
+    ipc[1] = ipc_open_channel();
+    if( ipc[0] == -1 || ipc[1] == -1 ){
+        printf( PROC_NAME ": could not open ipc!\n");
+        return 1;
+    }
+
+    start = now() + 0.1;
+    for(i = 0; i < 4; i++){
+        if( (pids[i] = fork()) == 0 ){
+            if( i < 2 )
+                exit(sender(ipc[i], i));
+            exit(drainer(ipc[3-i], i-2));
+        } else if( pids[i] == -1 ){
+            //child was not created :^(
+            printf( PROC_NAME ": error - child process could not be created.\n");
+            result = 2;
+            break;
+        }
+    }
+
+    for(j = i; j < 4; j++)
+        pids[j] = -1;
+    for(i = 0; i < 4; i++){
+        if( pids[i] == -1 )
+            continue;
+        // once one side gives up, the rest may be blocked on the device forever
+        if( result != 0 )
+            kill(pids[i], SIGKILL);
+        waitpid(pids[i], &status, 0);
+        if( result == 0 && (!WIFEXITED(status) || WEXITSTATUS(status) != 0) ){
+            result = 1;
+            for(j = 0; j < 4; j++){
+                if( pids[j] != -1 )
+                    kill(pids[j], SIGKILL);
+            }
+        }
+    }
+
+    ipc_close_channel(ipc[0]);
+    ipc_close_channel(ipc[1]);
+    return result;
+}
+
+int main(int argc, char **argv){
+    int result = 0;
+
+    argc--;
+    argv++;
+    for(;argc > 2;argc-=2, argv+=2){
+        if( !strncmp(argv[0],"-t",3) ){
+            tap_seconds = atoi(argv[1]);
+        } else if( !strncmp(argv[0],"-x",3) ){
+            scale = atof(argv[1]);
+        } else {
+            break;
+        }
+    }
+    if( argc != 1 || tap_seconds < 0 || scale < 0 ){
+        printf("USAGE: " PROC_NAME " -t seconds capture_file\n"
+            "       " PROC_NAME " [-x speedup] capture_file\n");
+        return 1;
+    }
+
+    if( tap_seconds > 0 )
+        return tap(argv[0]);
+
+    result = load(argv[0]);
+    if( result == 0 && n_entries == 0 )
+        printf( PROC_NAME ": %s has no messages in it\n", argv[0]);
+    if( result == 0 && n_entries > 0 )
+        result = replay();
+    return result;
+}
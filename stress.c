@@ -0,0 +1,338 @@
+/*
+ * stress, a multi-process soak test for the ipcdevice module.
+ * Copyright (C) 2012  Nate Bragg
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ *
+ *
+ * A producer and a consumer process, each pinned to its own CPU, push
+ * randomly sized messages with random transform combinations through the
+ * device for a fixed duration.  Both sides draw from the same seeded
+ * generator, so the consumer can rebuild every message and check it byte for
+ * byte against reference_transform.  Throughput is sampled once a second
+ * into a CSV file so slowdowns over long runs show up.
+ */
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include "libipcdevice.h"
+#include "reference.h"
+
+#define PROC_NAME "stress"
+
+int duration = 10;
+int producer_cpu = 0;
+int consumer_cpu = 1;
+uint64_t seed = 1;
+size_t max_size = 1024*1024;
+double baseline = 0;
+char *csv_name = "stress.csv";
+volatile sig_atomic_t producer_done = 0;
+
+struct message{
+    char *body;
+    size_t len;
+    int mask;
+};
+
+uint64_t next_random(uint64_t *state){
+    // xorshift64*
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+/*
+ * Produce the next message in the sequence into msg->body, which must hold
+ * max_size bytes.  msg->mask carries over from the last message, and must
+ * start out 0.  Sizes are mostly small, with the odd one far bigger than
+ * the ring or big enough for the parallel transform path; bodies are text so
+ * that the compressor has something to do.
+ */
+void next_message(uint64_t *state, struct message *msg){
+    static const char words[] = "lorem ipsum dolor sit amet, consectetur adipiscing elit ";
+    uint64_t r = next_random(state);
+    size_t i;
+
+    switch( r % 8 ){
+    case 0:
+        msg->len = 1 + next_random(state) % max_size;
+        break;
+    case 1:
+    case 2:
+        msg->len = 1 + next_random(state) % 16384;
+        break;
+    default:
+        msg->len = 1 + next_random(state) % 1024;
+        break;
+    }
+    // transforms come in runs, as a real channel's would; changing them
+    // costs the producer an ioctl per option
+    r = next_random(state);
+    if( r % 16 == 0 )
+        msg->mask = (r >> 8) & (IPC_XF_ROT13 | IPC_XF_BASE64 |
+            IPC_XF_REVERSE | IPC_XF_LZ4 | IPC_XF_CRC32C);
+
+    r = next_random(state);
+    for(i = 0; i < msg->len; i++){
+        if( i % 64 == 0 )
+            r = next_random(state);
+        // mostly words, with some noise mixed in
+        msg->body[i] = (r & 7) ? words[(i + r) % (sizeof(words)-1)] : (char)(r >> 8) + i;
+    }
+}
+
+int pin(int cpu){
+    cpu_set_t set;
+    if( cpu < 0 )
+        return 0;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set);
+}
+
+double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+int producer(void){
+    int ipc = -1;
+    uint64_t state = seed;
+    struct message msg;
+    int mask = 0;
+    double end;
+    ssize_t bytes_written;
+
+    if( pin(producer_cpu) == -1 )
+        printf( PROC_NAME ": could not pin producer to cpu %d\n", producer_cpu );
+
+    ipc = ipc_open_channel();
+    if( ipc == -1 ){
+        printf( PROC_NAME ": could not open ipc for writing!\n");
+        return 1;
+    }
+
+    msg.body = malloc(max_size);
+    msg.mask = 0;
+    end = now() + duration;
+    while( now() < end ){
+        next_message(&state, &msg);
+        if( msg.mask != mask ){
+            mask = msg.mask;
+            ipc_set_transforms(ipc, mask);
+        }
+        bytes_written = ipc_send(ipc, msg.body, msg.len);
+        if( bytes_written != msg.len ){
+            printf( PROC_NAME ": trouble writing %zu byte message: only wrote %zd"
+                " bytes.\n", msg.len, bytes_written);
+            // no end marker, so the run can't look like it passed
+            free(msg.body);
+            ipc_close_channel(ipc);
+            return 1;
+        }
+    }
+
+    // an empty message marks the end of the run
+    ipc_set_transforms(ipc, 0);
+    ipc_send(ipc, msg.body, 0);
+
+    free(msg.body);
+    ipc_close_channel(ipc);
+    return 0;
+}
+
+int consumer(void){
+    int ipc = -1;
+    uint64_t state = seed;
+    struct message msg;
+    char *expected = NULL, *received = NULL;
+    size_t expected_len, count = 0, total_bytes = 0, interval_bytes = 0;
+    size_t interval_count = 0;
+    ssize_t bytes_read;
+    double start, last, t, first_rate = -1, last_rate = 0;
+    FILE *csv = NULL;
+    int result = 0;
+
+    if( pin(consumer_cpu) == -1 )
+        printf( PROC_NAME ": could not pin consumer to cpu %d\n", consumer_cpu );
+
+    ipc = ipc_open_channel();
+    if( ipc == -1 ){
+        printf( PROC_NAME ": could not open ipc for reading!\n");
+        return 1;
+    }
+
+    csv = fopen(csv_name, "w");
+    if( csv == NULL ){
+        printf( PROC_NAME ": could not open %s!\n", csv_name);
+        ipc_close_channel(ipc);
+        return 1;
+    }
+    fprintf(csv, "seconds,messages,bytes,mb_per_sec\n");
+
+    msg.body = malloc(max_size);
+    msg.mask = 0;
+    expected = malloc(max_size/3*4 + 4);
+    start = last = now();
+
+    while( 1 ){
+        bytes_read = ipc_recv_alloc(ipc, (void**)&received);
+        if( bytes_read == -1 ){
+            printf( PROC_NAME ": could not read message %zu!\n", count);
+            result = 1;
+            break;
+        }
+        if( bytes_read == 0 ){
+            free(received);
+            break;
+        }
+
+        next_message(&state, &msg);
+        expected_len = reference_transform(msg.body, msg.len,
+            msg.mask & ~(IPC_XF_LZ4 | IPC_XF_CRC32C), expected);
+        if( bytes_read != expected_len || memcmp(received, expected, expected_len) ){
+            printf( PROC_NAME ": message %zu (%zu bytes, transforms 0x%x) came back"
+                " wrong: got %zd bytes.\n", count, msg.len, msg.mask, bytes_read);
+            free(received);
+            result = 2;
+            break;
+        }
+        free(received);
+
+        count++;
+        interval_count++;
+        total_bytes += msg.len;
+        interval_bytes += msg.len;
+
+        t = now();
+        if( t - last >= 1.0 ){
+            last_rate = interval_bytes/(t - last)/1e6;
+            if( first_rate < 0 )
+                first_rate = last_rate;
+            fprintf(csv, "%.1f,%zu,%zu,%.3f\n", t - start, interval_count,
+                interval_bytes, last_rate);
+            fflush(csv);
+            interval_count = interval_bytes = 0;
+            last = t;
+        }
+    }
+
+    t = now() - start;
+    printf( PROC_NAME ": %zu messages, %zu bytes in %.1fs: %.3f MB/s\n",
+        count, total_bytes, t, total_bytes/t/1e6 );
+    if( first_rate > 0 )
+        printf( PROC_NAME ": last second ran at %.0f%% of the first\n",
+            100*last_rate/first_rate );
+    if( result == 0 && baseline > 0 && total_bytes/t/1e6 < baseline ){
+        printf( PROC_NAME ": throughput is below the %.3f MB/s baseline!\n", baseline );
+        result = 3;
+    }
+
+    fclose(csv);
+    free(expected);
+    free(msg.body);
+    ipc_close_channel(ipc);
+    return result;
+}
+
+/*
+ * A producer that gives up sends no end marker, and the consumer would wait
+ * on it forever, so fail as soon as it exits badly.
+ */
+void reap_producer(int sig){
+    static const char msg[] = PROC_NAME ": producer failed!\n";
+    int status, saved_errno = errno;
+
+    (void)sig;
+    // the producer is the only child
+    if( waitpid(-1, &status, WNOHANG) > 0 ){
+        if( !WIFEXITED(status) || WEXITSTATUS(status) != 0 ){
+            write(STDOUT_FILENO, msg, sizeof(msg)-1);
+            _exit(1);
+        }
+        producer_done = 1;
+    }
+    errno = saved_errno;
+}
+
+int main(int argc, char **argv){
+    int result = 0, status = 0;
+    pid_t pid;
+    struct sigaction sa;
+
+    argc--;
+    argv++;
+    for(;argc > 1;argc-=2, argv+=2){
+        if( !strncmp(argv[0],"-d",3) ){
+            duration = atoi(argv[1]);
+        } else if( !strncmp(argv[0],"-p",3) ){
+            producer_cpu = atoi(argv[1]);
+        } else if( !strncmp(argv[0],"-c",3) ){
+            consumer_cpu = atoi(argv[1]);
+        } else if( !strncmp(argv[0],"-s",3) ){
+            seed = strtoull(argv[1], NULL, 0);
+        } else if( !strncmp(argv[0],"-m",3) ){
+            max_size = strtoul(argv[1], NULL, 0);
+        } else if( !strncmp(argv[0],"-b",3) ){
+            baseline = atof(argv[1]);
+        } else if( !strncmp(argv[0],"-o",3) ){
+            csv_name = argv[1];
+        } else {
+            break;
+        }
+    }
+    if( argc != 0 || seed == 0 || max_size == 0 ){
+        printf("USAGE: " PROC_NAME " [-d seconds] [-p producer_cpu] [-c consumer_cpu]"
+            " [-s seed] [-m max_size] [-b baseline_mb_per_sec] [-o csv_file]\n");
+        return 1;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = reap_producer;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigaction(SIGCHLD, &sa, NULL);
+
+    if( (pid = fork()) == 0 ){
+        signal(SIGCHLD, SIG_DFL);
+        return producer();
+    } else if( pid == -1 ){
+        //child was not created :^(
+        printf( PROC_NAME ": error - child process could not be created.\n");
+        return 2;
+    }
+    result = consumer();
+    signal(SIGCHLD, SIG_DFL);
+    if( producer_done )
+        return result;
+    // a producer blocked on a full ring would otherwise wait forever
+    if( result != 0 )
+        kill(pid, SIGKILL);
+    waitpid(pid, &status, 0);
+    if( result == 0 && (!WIFEXITED(status) || WEXITSTATUS(status) != 0) )
+        result = 1;
+    return result;
+}
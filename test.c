@@ -19,31 +19,37 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 
-#include "ipcdevice.h"
+#include "libipcdevice.h"
+#include "reference.h"
 
 #define ASSERT_EQ( p1, p2 ) do{ if ((p1) != (p2)) { printf("ASSERT FAILED(%d): " # p1 " does not equal " # p2 "\n\t" # p1 " = %d\n\t" # p2 " = %d\n", __LINE__, (int)p1, (int)p2 ); result += 1; } }while(0)
 #define ASSERT_NEQ( p1, p2 ) do{ if ((p1) == (p2)) { printf("ASSERT FAILED(%d): " # p1 " equals " # p2 "\n\t" # p1 " = %d\n\t" # p2 " = %d\n", __LINE__, (int)p1, (int)p2 ); result += 1; } }while(0)
 #define ASSERT_STR_EQ( p1, p2, bsize ) do{ if ( strncmp(p1, p2, bsize) ) { printf("ASSERT FAILED(%d): " # p1 " != " # p2 "\n\t" # p1 " = %.*s\n\t" # p2 " = %.*s\n", __LINE__, bsize, p1, bsize, p2 ); result += 1; } }while(0)
 
-int ipc_file_fixture( int(*fp)(FILE *, FILE*) ){
-    FILE *ipc_r = NULL, *ipc_w = NULL;
+int ipc_fixture( int(*fp)(int, int) ){
+    int ipc_r = -1, ipc_w = -1;
     int result = 0;
-    ipc_w = fopen("/dev/ipcdevice","w");
-    ASSERT_NEQ( ipc_w, NULL );
-    ipc_r = fopen("/dev/ipcdevice","r");
-    ASSERT_NEQ( ipc_r, NULL );
+    ipc_w = ipc_open_channel();
+    ASSERT_NEQ( ipc_w, -1 );
+    ipc_r = ipc_open_channel();
+    ASSERT_NEQ( ipc_r, -1 );
     if( !result )
         result = (*fp)(ipc_w, ipc_r);
-    fclose( ipc_w );
-    fclose( ipc_r );
+    ipc_close_channel( ipc_w );
+    ipc_close_channel( ipc_r );
+    return result;
 }
 
-int test_multi_read(FILE *ipc_w, FILE *ipc_r) {
+int test_multi_read(int ipc_w, int ipc_r) {
     char *message, *m_cursor;
     const char *expected = "shmowzow!";
-    size_t buf_size, bytes_read;
-    size_t len, bytes_written;
+    size_t buf_size;
+    ssize_t len, bytes_read, bytes_written;
     size_t total_bytes_read = 0;
     int result = 0;
 
@@ -51,12 +57,14 @@ int test_multi_read(FILE *ipc_w, FILE *ipc_r) {
     m_cursor = message = (char*)malloc(buf_size);
     memset(message, 0, buf_size);
 
+    // byte at a time only works with message mode off
+    ioctl(ipc_r, IPC_IOC_MSGMODE, IPC_DISABLE);
+
     len = strnlen(expected, buf_size) + 1;
-    bytes_written = fwrite(expected, sizeof(char), len, ipc_w);
+    bytes_written = ipc_send(ipc_w, expected, len);
     ASSERT_EQ( bytes_written, len );
-    fflush(ipc_w);
 
-    while( (bytes_read = fread(m_cursor, sizeof(char), 1, ipc_r)) == 1){
+    while( (bytes_read = read(ipc_r, m_cursor, 1)) == 1){
         total_bytes_read += bytes_read;
         m_cursor += bytes_read;
     }
@@ -67,34 +75,33 @@ int test_multi_read(FILE *ipc_w, FILE *ipc_r) {
     return result;
 }
 
-int test_single_read(FILE *ipc_w, FILE *ipc_r) {
+int test_single_read(int ipc_w, int ipc_r) {
     char *message;
     const char *expected = "shmowzow!";
-    size_t buf_size, bytes_read;
-    size_t len, bytes_written;
+    size_t buf_size;
+    ssize_t len, bytes_read, bytes_written;
     int result = 0;
 
+    buf_size = 20;
     len = strnlen(expected, buf_size) + 1;
-    bytes_written = fwrite(expected, sizeof(char), len, ipc_w);
+    bytes_written = ipc_send(ipc_w, expected, len);
     ASSERT_EQ( bytes_written, len );
-    fflush(ipc_w);
 
-    buf_size = 20;
     message = (char*)malloc(buf_size);
     memset(message, 0, buf_size);
 
-    bytes_read = fread(message, sizeof(char), buf_size, ipc_r);
+    bytes_read = ipc_recv(ipc_r, message, buf_size);
     ASSERT_EQ( len, bytes_read );
     ASSERT_STR_EQ( message, expected, buf_size );
     free( message );
     return result;
 }
 
-int test_corpus(FILE *ipc_w, FILE *ipc_r) {
+int test_corpus(int ipc_w, int ipc_r) {
     FILE *corpus = NULL;
     #define BUF_SIZE 1024
     char message[BUF_SIZE] = {0,}, expected[BUF_SIZE] = {0};
-    size_t len, bytes_written, bytes_read, bytes_retrieved;
+    ssize_t bytes_written, bytes_read, bytes_retrieved;
     int result = 0;
 
     corpus = fopen("corpora/lipsum_small", "r");
@@ -102,15 +109,15 @@ int test_corpus(FILE *ipc_w, FILE *ipc_r) {
 
     do{
         bytes_read = fread(message, sizeof(char), BUF_SIZE, corpus);
-        bytes_written = fwrite(message, sizeof(char), bytes_read, ipc_w);
+        bytes_written = ipc_send(ipc_w, message, bytes_read);
         ASSERT_EQ( bytes_written, bytes_read );
     }while( !feof( corpus ) );
-    fflush(ipc_w);
 
     rewind( corpus );
     do{
         bytes_read = fread(expected, sizeof(char), BUF_SIZE, corpus);
-        bytes_retrieved = fread(message, sizeof(char), BUF_SIZE, ipc_r);
+        bytes_retrieved = ipc_recv(ipc_r, message, BUF_SIZE);
+        ASSERT_EQ( bytes_retrieved, bytes_read );
         ASSERT_STR_EQ( message, expected, BUF_SIZE );
     }while( !feof( corpus ) );
 
@@ -118,64 +125,397 @@ int test_corpus(FILE *ipc_w, FILE *ipc_r) {
     return result;
 }
 
-int test_rot13(FILE *ipc_w, FILE *ipc_r) {
+int test_batch(int ipc_w, int ipc_r) {
+    char *input[3] = {"shmowzow!", "zip", "zap"};
+    char received[3][20];
+    struct iovec out[3], in[3];
+    int i, sent, got;
+    int result = 0;
+
+    for(i = 0; i < 3; i++){
+        out[i].iov_base = input[i];
+        out[i].iov_len = strlen(input[i]);
+        in[i].iov_base = received[i];
+        in[i].iov_len = sizeof(received[i]);
+    }
+
+    sent = ipc_send_batch(ipc_w, out, 3);
+    ASSERT_EQ( sent, 3 );
+    got = ipc_recv_batch(ipc_r, in, 3);
+    ASSERT_EQ( got, 3 );
+    for(i = 0; i < got; i++){
+        ASSERT_EQ( in[i].iov_len, out[i].iov_len );
+        ASSERT_STR_EQ( received[i], input[i], (int)out[i].iov_len );
+    }
+    return result;
+}
+
+int test_rot13(int ipc_w, int ipc_r) {
     char *message;
     const char *input  = "shmowzow!";
     const char *expected = "fuzbjmbj!";
-    size_t buf_size, bytes_read;
-    size_t len, bytes_written;
+    size_t buf_size;
+    ssize_t len, bytes_read, bytes_written;
     int result = 0;
 
-    ioctl(fileno(ipc_w), IPC_IOC_ROT13, 1);
+    buf_size = 20;
+    ipc_set_transforms(ipc_w, IPC_XF_ROT13);
     len = strnlen(input, buf_size) + 1;
-    bytes_written = fwrite(input, sizeof(char), len, ipc_w);
+    bytes_written = ipc_send(ipc_w, input, len);
     ASSERT_EQ( bytes_written, len );
-    fflush(ipc_w);
-    ioctl(fileno(ipc_w), IPC_IOC_ROT13, 0);
+    ipc_set_transforms(ipc_w, 0);
 
-    buf_size = 20;
     message = (char*)malloc(buf_size);
     memset(message, 0, buf_size);
 
-    bytes_read = fread(message, sizeof(char), buf_size, ipc_r);
+    bytes_read = ipc_recv(ipc_r, message, buf_size);
     ASSERT_EQ( len, bytes_read );
     ASSERT_STR_EQ( message, expected, buf_size );
     free( message );
     return result;
 }
 
-int test_reverse(FILE *ipc_w, FILE *ipc_r) {
+int test_reverse(int ipc_w, int ipc_r) {
     char *message;
     const char *input  = "shmowzow!";
     const char *expected = "!wozwomhs";
-    size_t buf_size, bytes_read;
-    size_t len, bytes_written;
+    size_t buf_size;
+    ssize_t len, bytes_read, bytes_written;
     int result = 0;
 
-    ioctl(fileno(ipc_w), IPC_IOC_REVERSE, 1);
+    buf_size = 20;
+    ipc_set_transforms(ipc_w, IPC_XF_REVERSE);
     len = strnlen(input, buf_size);
-    bytes_written = fwrite(input, sizeof(char), len, ipc_w);
+    bytes_written = ipc_send(ipc_w, input, len);
     ASSERT_EQ( bytes_written, len );
-    fflush(ipc_w);
-    ioctl(fileno(ipc_w), IPC_IOC_REVERSE, 0);
+    ipc_set_transforms(ipc_w, 0);
 
-    buf_size = 20;
     message = (char*)malloc(buf_size);
     memset(message, 0, buf_size);
 
-    bytes_read = fread(message, sizeof(char), buf_size, ipc_r);
+    bytes_read = ipc_recv(ipc_r, message, buf_size);
     ASSERT_EQ( len, bytes_read );
-    ASSERT_STR_EQ( message, expected, bytes_read );
+    ASSERT_STR_EQ( message, expected, (int)bytes_read );
+    free( message );
+    return result;
+}
+
+int test_peeklen(int ipc_w, int ipc_r) {
+    char *message;
+    const char *expected = "shmowzow!";
+    ssize_t len, peeked, bytes_written, bytes_read;
+    int result = 0;
+
+    peeked = ipc_pending(ipc_r);
+    ASSERT_EQ( peeked, 0 );
+
+    len = strlen(expected) + 1;
+    bytes_written = ipc_send(ipc_w, expected, len);
+    ASSERT_EQ( bytes_written, len );
+
+    peeked = ipc_peek_len(ipc_r);
+    ASSERT_EQ( peeked, len );
+    peeked = ipc_pending(ipc_r);
+    ASSERT_EQ( peeked, len );
+
+    message = (char*)malloc(peeked);
+    memset(message, 0, peeked);
+
+    bytes_read = ipc_recv(ipc_r, message, peeked-1);
+    ASSERT_EQ( bytes_read, -1 );
+    bytes_read = ipc_recv(ipc_r, message, peeked);
+    ASSERT_EQ( bytes_read, len );
+    ASSERT_STR_EQ( message, expected, (int)peeked );
     free( message );
+
+    // no zero-length read should follow the message in message mode
+    bytes_written = ipc_send(ipc_w, expected, len);
+    bytes_read = ipc_recv_alloc(ipc_r, (void**)&message);
+    ASSERT_EQ( bytes_read, len );
+    ASSERT_STR_EQ( message, expected, (int)len );
+    free( message );
+    return result;
+}
+
+int test_lz4(int ipc_w, int ipc_r) {
+    FILE *corpus = NULL;
+    char message[BUF_SIZE] = {0,}, expected[BUF_SIZE] = {0};
+    ssize_t len, bytes_written, bytes_read;
+    int result = 0;
+
+    corpus = fopen("corpora/lipsum_small", "r");
+    ASSERT_NEQ( corpus, NULL );
+    len = fread(expected, sizeof(char), BUF_SIZE, corpus);
+    fclose( corpus );
+
+    ipc_set_transforms(ipc_w, IPC_XF_LZ4);
+    bytes_written = ipc_send(ipc_w, expected, len);
+    ASSERT_EQ( bytes_written, len );
+    ipc_set_transforms(ipc_w, 0);
+
+    bytes_read = ipc_recv(ipc_r, message, BUF_SIZE);
+    ASSERT_EQ( bytes_read, len );
+    ASSERT_STR_EQ( message, expected, BUF_SIZE );
+    return result;
+}
+
+int test_crc32c(int ipc_w, int ipc_r) {
+    char *message;
+    const char *input  = "shmowzow!";
+    const char *expected = "c2htb3d6b3ch";
+    size_t buf_size;
+    ssize_t len, bytes_read, bytes_written;
+    int result = 0;
+
+    ipc_set_transforms(ipc_w, IPC_XF_CRC32C | IPC_XF_BASE64);
+    len = strlen(input);
+    bytes_written = ipc_send(ipc_w, input, len);
+    ASSERT_EQ( bytes_written, len );
+    ipc_set_transforms(ipc_w, 0);
+
+    buf_size = 20;
+    message = (char*)malloc(buf_size);
+    memset(message, 0, buf_size);
+
+    bytes_read = ipc_recv(ipc_r, message, buf_size);
+    ASSERT_EQ( strlen(expected), bytes_read );
+    ASSERT_STR_EQ( message, expected, (int)bytes_read );
+    free( message );
+    return result;
+}
+
+int test_latency(int ipc_w, int ipc_r) {
+    char message[20];
+    const char *input = "shmowzow!";
+    struct ipc_lat_hist hist;
+    ssize_t len, bytes_read;
+    int i, total = 0;
+    int result = 0;
+
+    ipc_latency_reset(ipc_r);
+    ipc_set_transforms(ipc_w, IPC_XF_LATENCY);
+    len = strlen(input);
+    ipc_send(ipc_w, input, len);
+    ipc_set_transforms(ipc_w, 0);
+    ipc_send(ipc_w, input, len);
+
+    bytes_read = ipc_recv(ipc_r, message, sizeof(message));
+    ASSERT_EQ( bytes_read, len );
+    ASSERT_STR_EQ( message, input, (int)len );
+    bytes_read = ipc_recv(ipc_r, message, sizeof(message));
+    ASSERT_EQ( bytes_read, len );
+
+    // only the stamped message is counted
+    ASSERT_EQ( ipc_latency_hist(ipc_r, &hist), 0 );
+    for(i = 0; i < IPC_LAT_BUCKETS; i++)
+        total += hist.count[i];
+    ASSERT_EQ( total, 1 );
+
+    ipc_latency_reset(ipc_r);
+    ipc_latency_hist(ipc_r, &hist);
+    for(i = 0, total = 0; i < IPC_LAT_BUCKETS; i++)
+        total += hist.count[i];
+    ASSERT_EQ( total, 0 );
+    return result;
+}
+
+int test_parallel(int ipc_w, int ipc_r) {
+    // big enough to be split across CPUs, and not a multiple of 3
+    const size_t len = 3*256*1024 + 1;
+    const int mask = IPC_XF_ROT13 | IPC_XF_BASE64 | IPC_XF_REVERSE;
+    char *input, *expected, *message = NULL;
+    size_t i, expected_len;
+    ssize_t bytes_read;
+    pid_t pid;
+    int status = 0;
+    int result = 0;
+
+    input = (char*)malloc(len);
+    expected = (char*)malloc(len/3*4 + 4);
+    for(i = 0; i < len; i++)
+        input[i] = 'A' + (i*7)%58;
+    expected_len = reference_transform(input, len, mask, expected);
+
+    // the message is far bigger than the ring, so it needs its own writer
+    if( (pid = fork()) == 0 ){
+        ipc_set_transforms(ipc_w, mask);
+        _exit( ipc_send(ipc_w, input, len) != len );
+    }
+    ASSERT_NEQ( pid, -1 );
+
+    bytes_read = ipc_recv_alloc(ipc_r, (void**)&message);
+    ASSERT_EQ( bytes_read, expected_len );
+    ASSERT_EQ( memcmp(message, expected, expected_len), 0 );
+    waitpid(pid, &status, 0);
+    ASSERT_EQ( WIFEXITED(status) && WEXITSTATUS(status) == 0, 1 );
+    // the child's options live on in the device for the next test
+    ipc_set_transforms(ipc_w, 0);
+
+    free( message );
+    free( expected );
+    free( input );
+    return result;
+}
+
+int test_overwrite(int ipc_w, int ipc_r) {
+    char input[3][400], message[400], too_big[2000] = {0,};
+    struct ipc_drop_stats dropped;
+    ssize_t bytes_written, bytes_read;
+    int i;
+    int result = 0;
+
+    ipc_set_transforms(ipc_w, IPC_XF_OVERWRITE);
+    for(i = 0; i < 3; i++){
+        memset(input[i], 'a'+i, sizeof(input[i]));
+        // the ring only holds two of these, so the third evicts the first
+        bytes_written = ipc_send(ipc_w, input[i], sizeof(input[i]));
+        ASSERT_EQ( bytes_written, sizeof(input[i]) );
+    }
+    bytes_written = ipc_send(ipc_w, too_big, sizeof(too_big));
+    ASSERT_EQ( bytes_written, -1 );
+    ipc_set_transforms(ipc_w, 0);
+
+    ASSERT_EQ( ipc_dropped(ipc_r, &dropped), 0 );
+    ASSERT_EQ( dropped.messages, 1 );
+    ASSERT_EQ( dropped.bytes, sizeof(input[0]) );
+
+    for(i = 1; i < 3; i++){
+        bytes_read = ipc_recv(ipc_r, message, sizeof(message));
+        ASSERT_EQ( bytes_read, sizeof(input[i]) );
+        ASSERT_EQ( memcmp(message, input[i], sizeof(message)), 0 );
+    }
+
+    ipc_dropped(ipc_r, &dropped);
+    ASSERT_EQ( dropped.messages, 0 );
+    return result;
+}
+
+int test_filter(int ipc_w, int ipc_r) {
+    const char *input[3] = {"zip", "zap", "shmowzow!"};
+    unsigned int types[3] = {1, 2, 0};
+    char message[20];
+    ssize_t bytes_read;
+    int i;
+    int result = 0;
+
+    ipc_set_filter(ipc_r, 2, 2);
+    for(i = 0; i < 3; i++){
+        ipc_set_type(ipc_w, types[i]);
+        ipc_send(ipc_w, input[i], strlen(input[i]));
+    }
+    ipc_set_type(ipc_w, 0);
+
+    bytes_read = ipc_recv(ipc_r, message, sizeof(message));
+    ASSERT_EQ( bytes_read, strlen(input[1]) );
+    ASSERT_STR_EQ( message, input[1], (int)bytes_read );
+
+    // the untyped message behind it is filtered out too
+    ASSERT_EQ( ipc_pending(ipc_r), 0 );
+
+    ipc_set_filter(ipc_r, 0, ~0U);
+    ipc_send(ipc_w, input[2], strlen(input[2]));
+    bytes_read = ipc_recv(ipc_r, message, sizeof(message));
+    ASSERT_EQ( bytes_read, strlen(input[2]) );
+    return result;
+}
+
+int test_filter_overwrite(int ipc_w, int ipc_r) {
+    const char *wanted = "shmowzow!";
+    char junk[300], message[20];
+    ssize_t bytes_read;
+    pid_t pid;
+    int i, status = 0;
+    int result = 0;
+
+    ipc_set_filter(ipc_r, 5, 5);
+    // the reader has to be asleep in the kernel before the junk arrives
+    if( (pid = fork()) == 0 ){
+        // a reader that is never woken would hang the whole run
+        alarm(5);
+        bytes_read = ipc_recv(ipc_r, message, sizeof(message));
+        _exit( bytes_read != strlen(wanted) || strncmp(message, wanted, bytes_read) );
+    }
+    ASSERT_NEQ( pid, -1 );
+    usleep(100000);
+
+    // far more than the ring holds, none of which wakes the reader by type
+    memset(junk, 'j', sizeof(junk));
+    ipc_set_transforms(ipc_w, IPC_XF_OVERWRITE);
+    ipc_set_type(ipc_w, 3);
+    for(i = 0; i < 20; i++)
+        ASSERT_EQ( ipc_send(ipc_w, junk, sizeof(junk)), sizeof(junk) );
+    usleep(100000);
+    ipc_set_type(ipc_w, 5);
+    ASSERT_EQ( ipc_send(ipc_w, wanted, strlen(wanted)), strlen(wanted) );
+
+    waitpid(pid, &status, 0);
+    ASSERT_EQ( WIFEXITED(status) && WEXITSTATUS(status) == 0, 1 );
+    ipc_set_type(ipc_w, 0);
+    ipc_set_transforms(ipc_w, 0);
+    ipc_set_filter(ipc_r, 0, ~0U);
+    ASSERT_EQ( ipc_set_filter(ipc_r, 2, 1), -1 );
+    return result;
+}
+
+int test_capture(int ipc_w, int ipc_r) {
+    const char *input = "shmowzow!";
+    char message[20], tap[8192];
+    struct ipc_capture_record rec;
+    FILE *capture = NULL;
+    ssize_t bytes_read;
+    int result = 0;
+
+    ASSERT_EQ( ioctl(ipc_w, IPC_IOC_CAPTURE, IPC_ENABLE), 0 );
+    ASSERT_EQ( ioctl(ipc_w, IPC_IOC_SNAPLEN, 4), 0 );
+
+    // the tap needs debugfs, which is usually root only
+    capture = fopen(IPC_CAPTURE_PATH, "r");
+    if( capture != NULL ){
+        // throw away anything an earlier run left behind
+        while( read(fileno(capture), tap, sizeof(tap)) > 0 );
+    }
+
+    ipc_set_transforms(ipc_w, IPC_XF_ROT13);
+    ipc_send(ipc_w, input, strlen(input));
+    ipc_set_transforms(ipc_w, 0);
+    ioctl(ipc_w, IPC_IOC_CAPTURE, IPC_DISABLE);
+    bytes_read = ipc_recv(ipc_r, message, sizeof(message));
+    ASSERT_EQ( bytes_read, strlen(input) );
+
+    if( capture == NULL ){
+        printf("test_capture: can't open " IPC_CAPTURE_PATH ", so only the ioctls"
+            " were checked; run as root with debugfs mounted to check the records\n");
+        return result;
+    }
+    bytes_read = read(fileno(capture), tap, sizeof(tap));
+    ASSERT_EQ( bytes_read, sizeof(rec) + 4 );
+    memcpy(&rec, tap, sizeof(rec));
+    ASSERT_EQ( rec.length, strlen(input) );
+    ASSERT_EQ( rec.captured, 4 );
+    ASSERT_EQ( rec.direction, 0 );
+    ASSERT_EQ( rec.transforms, IPC_CAP_ROT13 );
+    // the payload is captured as the sender wrote it
+    ASSERT_STR_EQ( tap + sizeof(rec), input, 4 );
+    fclose(capture);
     return result;
 }
 
 int main(int argv, char **argc){
     int result = 0;
-    result += ipc_file_fixture(test_single_read);
-    result += ipc_file_fixture(test_multi_read);
-    result += ipc_file_fixture(test_corpus);
-    result += ipc_file_fixture(test_rot13);
-    result += ipc_file_fixture(test_reverse);
+    result += ipc_fixture(test_single_read);
+    result += ipc_fixture(test_multi_read);
+    result += ipc_fixture(test_corpus);
+    result += ipc_fixture(test_batch);
+    result += ipc_fixture(test_rot13);
+    result += ipc_fixture(test_reverse);
+    result += ipc_fixture(test_peeklen);
+    result += ipc_fixture(test_lz4);
+    result += ipc_fixture(test_crc32c);
+    result += ipc_fixture(test_latency);
+    result += ipc_fixture(test_parallel);
+    result += ipc_fixture(test_overwrite);
+    result += ipc_fixture(test_filter);
+    result += ipc_fixture(test_filter_overwrite);
+    result += ipc_fixture(test_capture);
     return result;
 }